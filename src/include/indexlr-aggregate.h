@@ -0,0 +1,296 @@
+#ifndef INDEXLR_AGGREGATE_H
+#define INDEXLR_AGGREGATE_H
+
+#include "IOUtil.h"
+#include "indexlr-fastx.h"
+#include "physlr-mxstream.h"
+#include "tsl/robin_map.h"
+
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <iterator>
+#include <memory>
+#include <mutex>
+#include <queue>
+#include <string>
+#include <utility>
+#include <vector>
+
+// Number of independently locked shards of the barcodes
+const size_t AGGREGATE_SHARDS = 256;
+// Approximate memory used by a barcode in addition to its characters and minimizers
+const size_t AGGREGATE_BARCODE_OVERHEAD = 64;
+
+// Merge the minimizers of the reads of each barcode into one sorted set per barcode.
+// Minimize workers add reads concurrently to shards chosen by the hash of the barcode.
+// When the minimizers held in memory exceed the memory limit, all shards are spilled to a
+// temporary file as a run sorted by barcode, and the runs are merged when writing the output.
+class BarcodeAggregator
+{
+
+  public:
+	explicit BarcodeAggregator(size_t memoryLimit)
+	  : memoryLimit(memoryLimit)
+	  , shards(AGGREGATE_SHARDS)
+	{}
+
+	BarcodeAggregator(const BarcodeAggregator&) = delete;
+	BarcodeAggregator& operator=(const BarcodeAggregator&) = delete;
+
+	~BarcodeAggregator()
+	{
+		for (const auto& run : runs) {
+			std::remove(run.c_str());
+		}
+	}
+
+	// Add the sorted unique minimizers of a read of barcode bx.
+	void add(StringView bx, const uint64_t* mxs, size_t n)
+	{
+		Shard& shard = shards[hash(bx) % shards.size()];
+		{
+			std::lock_guard<std::mutex> lock(shard.mutex);
+			shard.key.assign(bx.data, bx.size);
+			auto it = shard.barcodes.find(shard.key);
+			if (it == shard.barcodes.end()) {
+				it = shard.barcodes.emplace(shard.key, Minimizers()).first;
+				memory += bx.size + AGGREGATE_BARCODE_OVERHEAD;
+			}
+			Minimizers& set = it.value();
+			set.mxs.insert(set.mxs.end(), mxs, mxs + n);
+			memory += n * sizeof(uint64_t);
+			// Merge the minimizers of the reads once they have doubled since the last merge.
+			if (set.mxs.size() >= 2 * set.merged + BLOCK_SIZE) {
+				memory -= compact(set) * sizeof(uint64_t);
+			}
+		}
+		if (memory.load(std::memory_order_relaxed) > memoryLimit) {
+			spill();
+		}
+	}
+
+	// Write one line or record per barcode, sorted by barcode, in TSV or the binary format.
+	void write(const std::string& opath, bool binary)
+	{
+		std::ofstream ofs(opath);
+		assert_good(ofs, opath);
+		std::unique_ptr<MxWriter> writer;
+		if (binary) {
+			writer.reset(new MxWriter(ofs, opath));
+		}
+		merge([&](const std::string& bx, const std::vector<uint64_t>& mxs) {
+			if (writer) {
+				writer->write(bx.data(), bx.size(), mxs.data(), mxs.size());
+				return;
+			}
+			ofs << bx;
+			char sep = '\t';
+			for (const auto mx : mxs) {
+				ofs << sep << mx;
+				sep = ' ';
+			}
+			if (mxs.empty()) {
+				ofs << sep;
+			}
+			ofs << '\n';
+			assert_good(ofs, opath);
+		});
+		if (writer) {
+			writer->flush();
+		}
+		ofs.flush();
+		assert_good(ofs, opath);
+	}
+
+  private:
+	// The minimizers of a barcode, of which the first merged are sorted and unique
+	struct Minimizers
+	{
+		std::vector<uint64_t> mxs;
+		size_t merged = 0;
+	};
+
+	struct Shard
+	{
+		std::mutex mutex;
+		tsl::robin_map<std::string, Minimizers> barcodes;
+		std::string key;
+	};
+
+	// A sorted source of barcodes and minimizers being merged
+	struct Cursor
+	{
+		std::string bx;
+		std::vector<uint64_t> mxs;
+		std::function<bool(std::string&, std::vector<uint64_t>&)> next;
+	};
+
+	const size_t memoryLimit;
+	std::vector<Shard> shards;
+	std::atomic<size_t> memory{ 0 };
+	std::mutex spillMutex;
+	std::vector<std::string> runs;
+
+	// FNV-1a, which chooses the shard without copying the barcode
+	static size_t hash(StringView bx)
+	{
+		uint64_t h = 0xcbf29ce484222325;
+		for (size_t i = 0; i < bx.size; ++i) {
+			h = (h ^ static_cast<unsigned char>(bx[i])) * 0x100000001b3;
+		}
+		return h;
+	}
+
+	// Sort and deduplicate the minimizers, and return the number removed.
+	static size_t compact(Minimizers& set)
+	{
+		size_t size = set.mxs.size();
+		std::sort(set.mxs.begin(), set.mxs.end());
+		set.mxs.erase(std::unique(set.mxs.begin(), set.mxs.end()), set.mxs.end());
+		set.merged = set.mxs.size();
+		return size - set.mxs.size();
+	}
+
+	// Return the barcodes of all shards sorted, with their minimizers compacted.
+	// The caller holds the locks of all shards.
+	std::vector<std::pair<const std::string*, Minimizers*>> sortedBarcodes()
+	{
+		std::vector<std::pair<const std::string*, Minimizers*>> sorted;
+		for (auto& shard : shards) {
+			for (auto it = shard.barcodes.begin(); it != shard.barcodes.end(); ++it) {
+				compact(it.value());
+				sorted.emplace_back(&it->first, &it.value());
+			}
+		}
+		using Item = std::pair<const std::string*, Minimizers*>;
+		std::sort(sorted.begin(), sorted.end(), [](const Item& a, const Item& b) {
+			return *a.first < *b.first;
+		});
+		return sorted;
+	}
+
+	// Write the barcodes in memory to a temporary file as a sorted run, and free their memory.
+	void spill()
+	{
+		std::lock_guard<std::mutex> spillLock(spillMutex);
+		if (memory.load(std::memory_order_relaxed) <= memoryLimit) {
+			// Another thread spilled while this one waited.
+			return;
+		}
+		std::vector<std::unique_lock<std::mutex>> locks;
+		locks.reserve(shards.size());
+		for (auto& shard : shards) {
+			locks.emplace_back(shard.mutex);
+		}
+
+		const char* tmpdir = std::getenv("TMPDIR");
+		std::string path = std::string(tmpdir != nullptr ? tmpdir : "/tmp") +
+		                   "/physlr-indexlr.XXXXXX";
+		int fd = mkstemp(&path[0]);
+		if (fd < 0) {
+			std::cerr << "physlr-indexlr: error: " << std::strerror(errno) << ": " << path
+			          << '\n';
+			exit(EXIT_FAILURE);
+		}
+		close(fd);
+		runs.push_back(path);
+		{
+			std::ofstream ofs(path, std::ios::binary);
+			assert_good(ofs, path);
+			MxWriter writer(ofs, path);
+			for (const auto& item : sortedBarcodes()) {
+				const auto& mxs = item.second->mxs;
+				writer.write(item.first->data(), item.first->size(), mxs.data(), mxs.size());
+			}
+			writer.flush();
+			ofs.flush();
+			assert_good(ofs, path);
+		}
+		for (auto& shard : shards) {
+			tsl::robin_map<std::string, Minimizers>().swap(shard.barcodes);
+		}
+		memory.store(0, std::memory_order_relaxed);
+	}
+
+	// Merge the spilled runs and the barcodes in memory, and call
+	// emit(barcode, minimizers) for each barcode in sorted order.
+	template<typename Emit>
+	void merge(Emit emit)
+	{
+		std::vector<std::unique_ptr<std::ifstream>> files;
+		std::vector<std::unique_ptr<MxReader>> readers;
+		std::vector<Cursor> cursors;
+		for (const auto& run : runs) {
+			files.emplace_back(new std::ifstream(run, std::ios::binary));
+			assert_good(*files.back(), run);
+			readers.emplace_back(new MxReader(*files.back(), run));
+			MxReader& reader = *readers.back();
+			Cursor cursor;
+			cursor.next = [&reader](std::string& bx, std::vector<uint64_t>& mxs) {
+				return reader.read(bx, mxs);
+			};
+			cursors.push_back(std::move(cursor));
+		}
+		auto sorted = sortedBarcodes();
+		size_t i = 0;
+		Cursor cursor;
+		cursor.next = [&sorted, &i](std::string& bx, std::vector<uint64_t>& mxs) {
+			if (i == sorted.size()) {
+				return false;
+			}
+			bx = *sorted[i].first;
+			mxs.swap(sorted[i].second->mxs);
+			++i;
+			return true;
+		};
+		cursors.push_back(std::move(cursor));
+
+		// A min-heap of the cursors that have a barcode, ordered by barcode
+		auto greater = [&cursors](size_t a, size_t b) { return cursors[a].bx > cursors[b].bx; };
+		std::priority_queue<size_t, std::vector<size_t>, decltype(greater)> heap(greater);
+		for (size_t c = 0; c < cursors.size(); ++c) {
+			if (cursors[c].next(cursors[c].bx, cursors[c].mxs)) {
+				heap.push(c);
+			}
+		}
+		std::string bx;
+		std::vector<uint64_t> mxs, merged;
+		while (!heap.empty()) {
+			size_t c = heap.top();
+			heap.pop();
+			bx.swap(cursors[c].bx);
+			mxs.swap(cursors[c].mxs);
+			if (cursors[c].next(cursors[c].bx, cursors[c].mxs)) {
+				heap.push(c);
+			}
+			// Union the minimizers of this barcode from every run.
+			while (!heap.empty() && cursors[heap.top()].bx == bx) {
+				c = heap.top();
+				heap.pop();
+				merged.clear();
+				std::set_union(
+				    mxs.begin(),
+				    mxs.end(),
+				    cursors[c].mxs.begin(),
+				    cursors[c].mxs.end(),
+				    std::back_inserter(merged));
+				mxs.swap(merged);
+				if (cursors[c].next(cursors[c].bx, cursors[c].mxs)) {
+					heap.push(c);
+				}
+			}
+			emit(bx, mxs);
+		}
+	}
+};
+
+#endif
@@ -2,14 +2,16 @@
 #define INDEXLR_BUFFER_H
 
 #include <atomic>
-#include <condition_variable>
-#include <mutex>
-#include <string>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <thread>
 #include <utility>
 #include <vector>
 
 const size_t BLOCK_SIZE = 64;
 const size_t BUFFER_SIZE = 16384;
+const size_t CACHE_LINE_SIZE = 64;
 
 // A block of data, so that threads don't work with one read at a time
 template<typename T>
@@ -20,16 +22,72 @@ struct Block
 	size_t num = 0;
 };
 
-// Surrounds pieces of data in the buffer with a busy mutex
-// for exclusive access
+// The number of times that threads waited on a buffer, and the total time they waited
+struct WaitStats
+{
+	std::atomic<uint64_t> waits{ 0 };
+	std::atomic<uint64_t> nanoseconds{ 0 };
+};
+
+// Wait for another thread without a lock: spin briefly, then yield, then sleep,
+// so that an idle thread neither burns a core nor needs to be notified.
+// With stats, the time from the first wait to the destruction of the backoff is added to them.
+class Backoff
+{
+
+  public:
+	Backoff() = default;
+
+	explicit Backoff(WaitStats* stats)
+	  : stats(stats)
+	{}
+
+	Backoff(const Backoff&) = delete;
+	Backoff& operator=(const Backoff&) = delete;
+
+	~Backoff()
+	{
+		if (stats != nullptr && spins > 0) {
+			auto elapsed = std::chrono::steady_clock::now() - start;
+			stats->waits.fetch_add(1, std::memory_order_relaxed);
+			stats->nanoseconds.fetch_add(
+			    std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count(),
+			    std::memory_order_relaxed);
+		}
+	}
+
+	void wait()
+	{
+		if (spins == 0 && stats != nullptr) {
+			start = std::chrono::steady_clock::now();
+		}
+		if (spins < SPIN_LIMIT) {
+			++spins;
+		} else if (spins < YIELD_LIMIT) {
+			++spins;
+			std::this_thread::yield();
+		} else {
+			std::this_thread::sleep_for(std::chrono::microseconds(SLEEP_MICROSECONDS));
+		}
+	}
+
+  private:
+	static const unsigned SPIN_LIMIT = 64;
+	static const unsigned YIELD_LIMIT = 256;
+	static const unsigned SLEEP_MICROSECONDS = 50;
+	unsigned spins = 0;
+	WaitStats* stats = nullptr;
+	std::chrono::steady_clock::time_point start;
+};
+
+// A piece of data in the buffer tagged with a sequence number that says whose turn it is.
+// The slot is free for element n when seq == n, and holds element n when seq == n + 1.
+// A consumer frees it for the next lap around the buffer by setting seq = n + capacity.
 template<typename T>
 struct Slot
 {
+	std::atomic<size_t> seq{ 0 };
 	T data;
-	std::mutex busy;
-	bool occupied = false;
-	std::condition_variable occupancyChanged;
-	int64_t lastTenant = -1; // Required to ensure read order
 };
 
 template<typename T>
@@ -37,116 +95,182 @@ class Buffer
 {
 
   public:
-	size_t elements() const { return elementCount; }
-
-	void close()
+	explicit Buffer(size_t capacity = BUFFER_SIZE)
+	  : capacity(capacity)
+	  , slots(capacity)
 	{
-		closed = true;
-		for (Slot<T>& slot : this->slots) {
-			slot.occupancyChanged.notify_all();
+		for (size_t i = 0; i < capacity; ++i) {
+			slots[i].seq.store(i, std::memory_order_relaxed);
 		}
 	}
 
-	bool isClosed() const { return closed; }
+	// Approximate number of elements waiting in the buffer
+	size_t elements() const
+	{
+		size_t written = writeCounter.load(std::memory_order_relaxed);
+		size_t read = readCounter.load(std::memory_order_relaxed);
+		return written > read ? written - read : 0;
+	}
+
+	size_t getCapacity() const { return capacity; }
+
+	// The waits of producers for a slot to be read, when the buffer is full
+	const WaitStats& getFullWaits() const { return fullWaits; }
+
+	// The waits of consumers for a slot to be written, when the buffer is empty
+	const WaitStats& getEmptyWaits() const { return emptyWaits; }
+
+	// No more elements will be written once the buffer is closed.
+	void close() { closed.store(true, std::memory_order_release); }
+
+	bool isClosed() const { return closed.load(std::memory_order_acquire); }
 
   protected:
-	std::vector<Slot<T>> slots{ BUFFER_SIZE };
-	size_t readCounter = 0;
-	std::atomic<size_t> elementCount{ 0 };
-	std::atomic<bool> closed{ false };
+	const size_t capacity;
+	std::vector<Slot<T>> slots;
+	alignas(CACHE_LINE_SIZE) std::atomic<size_t> writeCounter{ 0 };
+	alignas(CACHE_LINE_SIZE) std::atomic<size_t> readCounter{ 0 };
+	alignas(CACHE_LINE_SIZE) std::atomic<bool> closed{ false };
+	alignas(CACHE_LINE_SIZE) WaitStats fullWaits;
+	WaitStats emptyWaits;
 };
 
+// Multiple-consumer queue. Elements are read in the order they are written. Several producers
+// may write to it by claiming the position of their next element and then writing it.
 template<typename T>
 class InputBuffer : public Buffer<T>
 {
 
   public:
-	// For a direct write to a slot, instead of copying into it
-	T& getWriteAccess(size_t num)
+	using Buffer<T>::Buffer;
+
+	// For a direct write to the next slot, instead of copying into it, when there is only one
+	// producer. Not to be mixed with claim and write.
+	T& getWriteAccess()
 	{
-		Slot<T>& target = this->slots[num / BLOCK_SIZE % BUFFER_SIZE];
-		std::unique_lock<std::mutex> busyLock(target.busy);
-		target.occupancyChanged.wait(busyLock, [&] { return !target.occupied; });
-		busyLock.release();
+		size_t pos = this->writeCounter.load(std::memory_order_relaxed);
+		Slot<T>& target = this->slots[pos % this->capacity];
+		Backoff backoff(&this->fullWaits);
+		while (target.seq.load(std::memory_order_acquire) != pos) {
+			backoff.wait();
+		}
 		return target.data;
 	}
 
-	void releaseWriteAccess(size_t num)
+	// Publish the slot returned by getWriteAccess to the consumers.
+	void releaseWriteAccess()
 	{
-		Slot<T>& target = this->slots[num / BLOCK_SIZE % BUFFER_SIZE];
-		target.occupied = true;
-		target.occupancyChanged.notify_one();
-		++(this->elementCount);
-		target.busy.unlock();
+		size_t pos = this->writeCounter.load(std::memory_order_relaxed);
+		this->slots[pos % this->capacity].seq.store(pos + 1, std::memory_order_release);
+		this->writeCounter.store(pos + 1, std::memory_order_release);
 	}
 
-	void write(T& data)
+	// Claim the position of the next element to be written by one of several producers.
+	size_t claim() { return this->writeCounter.fetch_add(1, std::memory_order_relaxed); }
+
+	// Swap data into the claimed position pos, handing the old content of the slot back to the
+	// caller so that its memory is reused. Every claimed position must be written before the
+	// buffer is closed.
+	void write(T& data, size_t pos)
 	{
-		size_t num = data.num / BLOCK_SIZE;
-		Slot<T>& target = this->slots[num % BUFFER_SIZE];
-		std::unique_lock<std::mutex> busyLock(target.busy);
-		target.occupancyChanged.wait(busyLock, [&] { return !target.occupied; });
-		target.data = std::move(data);
-		target.occupied = true;
-		target.occupancyChanged.notify_one();
-		++(this->elementCount);
+		Slot<T>& target = this->slots[pos % this->capacity];
+		Backoff backoff(&this->fullWaits);
+		while (target.seq.load(std::memory_order_acquire) != pos) {
+			backoff.wait();
+		}
+		std::swap(target.data, data);
+		target.seq.store(pos + 1, std::memory_order_release);
 	}
 
-	void read(T& data)
+	// Swap the next element into data, handing the old content of data back to the buffer
+	// so that its memory is reused. Return false once the buffer is closed and drained.
+	bool read(T& data)
 	{
-		static std::mutex readMutex;
-		std::unique_lock<std::mutex> readLock(readMutex);
-
-		Slot<T>& target = this->slots[this->readCounter % BUFFER_SIZE];
-		std::unique_lock<std::mutex> busyLock(target.busy);
-		target.occupancyChanged.wait(busyLock, [&] { return target.occupied || this->closed; });
-		if (this->closed) {
-			return;
+		Backoff backoff(&this->emptyWaits);
+		size_t pos = this->readCounter.load(std::memory_order_relaxed);
+		while (true) {
+			Slot<T>& target = this->slots[pos % this->capacity];
+			size_t seq = target.seq.load(std::memory_order_acquire);
+			if (seq == pos + 1) {
+				if (this->readCounter.compare_exchange_weak(
+				        pos, pos + 1, std::memory_order_relaxed)) {
+					std::swap(data, target.data);
+					target.seq.store(pos + this->capacity, std::memory_order_release);
+					return true;
+				}
+			} else if (seq <= pos) {
+				// Not written yet
+				if (this->isClosed() &&
+				    pos >= this->writeCounter.load(std::memory_order_acquire)) {
+					return false;
+				}
+				backoff.wait();
+				pos = this->readCounter.load(std::memory_order_relaxed);
+			} else {
+				// Another consumer took this element
+				pos = this->readCounter.load(std::memory_order_relaxed);
+			}
 		}
-		++(this->readCounter);
-
-		readLock.unlock();
-
-		data = std::move(target.data);
-		target.occupied = false;
-		target.occupancyChanged.notify_one();
-		--(this->elementCount);
 	}
 };
 
+// Multiple-producer single-consumer queue that restores the order of the elements.
+// Producers may write elements in any order within capacity of the next element to be read.
+// Producers that do not need the order claim the next position when their element is ready,
+// so that none waits for a slower one.
 template<typename T>
 class OutputBuffer : public Buffer<T>
 {
 
   public:
-	void write(T& data)
+	using Buffer<T>::Buffer;
+
+	// Claim the next position, to write an element in the order that elements are ready.
+	// Not to be mixed with writes to positions chosen by the producers.
+	size_t claim() { return claimCounter.fetch_add(1, std::memory_order_relaxed); }
+
+	// Swap a block of data into its slot, handing the old content of the slot back to the caller.
+	void write(T& data) { write(data, data.num / BLOCK_SIZE); }
+
+	// Swap element number pos into its slot, handing the old content of the slot back to the
+	// caller.
+	void write(T& data, size_t pos)
 	{
-		size_t num = data.num / BLOCK_SIZE;
-		Slot<T>& target = this->slots[num % BUFFER_SIZE];
-		std::unique_lock<std::mutex> busyLock(target.busy);
-		target.occupancyChanged.wait(
-		    busyLock, [&] { return !target.occupied && (num - target.lastTenant <= BUFFER_SIZE); });
-		target.data = std::move(data);
-		target.occupied = true;
-		target.lastTenant = num;
-		target.occupancyChanged.notify_all();
-		++(this->elementCount);
+		Slot<T>& target = this->slots[pos % this->capacity];
+		Backoff backoff(&this->fullWaits);
+		while (target.seq.load(std::memory_order_acquire) != pos) {
+			backoff.wait();
+		}
+		std::swap(target.data, data);
+		target.seq.store(pos + 1, std::memory_order_release);
+		this->writeCounter.fetch_add(1, std::memory_order_relaxed);
 	}
 
-	void read(T& data)
+	// Swap the next element in order into data. Only one thread may read from the buffer.
+	// Return false once the buffer is closed and drained.
+	bool read(T& data)
 	{
-		Slot<T>& target = this->slots[this->readCounter % BUFFER_SIZE];
-		std::unique_lock<std::mutex> busyLock(target.busy);
-		target.occupancyChanged.wait(busyLock, [&] { return target.occupied || this->closed; });
-		if (this->closed) {
-			return;
+		size_t pos = this->readCounter.load(std::memory_order_relaxed);
+		Slot<T>& target = this->slots[pos % this->capacity];
+		Backoff backoff(&this->emptyWaits);
+		while (target.seq.load(std::memory_order_acquire) != pos + 1) {
+			if (this->isClosed()) {
+				// Every write happened before close, so check the slot one last time.
+				if (target.seq.load(std::memory_order_acquire) != pos + 1) {
+					return false;
+				}
+				break;
+			}
+			backoff.wait();
 		}
-		++(this->readCounter);
-		data = std::move(target.data);
-		target.occupied = false;
-		target.occupancyChanged.notify_all();
-		--(this->elementCount);
+		std::swap(data, target.data);
+		target.seq.store(pos + this->capacity, std::memory_order_release);
+		this->readCounter.store(pos + 1, std::memory_order_relaxed);
+		return true;
 	}
+
+  private:
+	alignas(CACHE_LINE_SIZE) std::atomic<size_t> claimCounter{ 0 };
 };
 
 #endif
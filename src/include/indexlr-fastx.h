@@ -0,0 +1,288 @@
+#ifndef INDEXLR_FASTX_H
+#define INDEXLR_FASTX_H
+
+#include "indexlr-buffer.h"
+#include "indexlr-inflate.h"
+
+#include <cctype>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <memory>
+#include <ostream>
+#include <string>
+#include <vector>
+
+// A view of characters stored elsewhere, like the std::string_view of C++17
+struct StringView
+{
+	const char* data = nullptr;
+	size_t size = 0;
+
+	StringView() = default;
+
+	StringView(const char* data, size_t size)
+	  : data(data)
+	  , size(size)
+	{}
+
+	bool empty() const { return size == 0; }
+
+	char operator[](size_t i) const { return data[i]; }
+
+	// Return true if this view starts with prefix and is longer than it.
+	template<size_t N>
+	bool startsWith(const char (&prefix)[N]) const
+	{
+		return size > N - 1 && std::memcmp(data, prefix, N - 1) == 0;
+	}
+
+	std::string str() const { return std::string(data, size); }
+};
+
+static inline std::ostream&
+operator<<(std::ostream& os, const StringView& s)
+{
+	return os.write(s.data, s.size);
+}
+
+// A read from input file with a number associated with it
+// where first read is 0, second 1, etc...
+// The strings are views into the arena of the block that holds the read.
+struct Read
+{
+	size_t num = 0;
+	StringView id;
+	StringView barcode;
+	StringView sequence;
+};
+
+struct SequencePieces;
+
+// A block of reads and the arena that stores their strings. The arena keeps its capacity when
+// the block is reused, so that parsing does not allocate memory in steady state.
+// A vector rather than a string, so that moving the block never moves the characters.
+struct ReadBlock : Block<Read>
+{
+	std::vector<char> arena;
+	// The position of the block among the blocks of all input files, which orders the output
+	size_t seq = 0;
+	// For a piece of a long sequence, which is the only read of its block, the pieces of the
+	// sequence, the number of this piece, the position of the piece in the sequence, and the
+	// number of k-mers at the start of the piece that belong to the previous piece
+	std::shared_ptr<SequencePieces> pieces;
+	size_t piece = 0;
+	size_t offset = 0;
+	size_t overlapKmers = 0;
+};
+
+// Parse FASTA and FASTQ records from an InflateStream into blocks of reads.
+// Multi-line FASTA and FASTQ records are supported, as with kseq.
+class FastxParser
+{
+
+  public:
+	explicit FastxParser(InflateStream& stream)
+	  : stream(stream)
+	{
+		fasta = stream.peek() == '>';
+	}
+
+	// Return true if the input is FASTA, in which case the barcode of a read is its ID.
+	bool isFasta() const { return fasta; }
+
+	// Fill block with up to BLOCK_SIZE reads, numbered from num.
+	// Return the number of reads parsed, which is zero at the end of the input.
+	inline size_t readBlock(ReadBlock& block, size_t num);
+
+  private:
+	// Offsets into the arena of the strings of one read, which become views once the arena
+	// stops growing
+	struct Extent
+	{
+		size_t offset = 0;
+		size_t size = 0;
+	};
+
+	InflateStream& stream;
+	bool fasta = false;
+	Chunk chunk;
+	size_t pos = 0;
+	// A line that spans chunks
+	std::string carry;
+	// The header line of the next record was read while reading the previous record.
+	bool havePending = false;
+	StringView pending;
+	Extent extents[BLOCK_SIZE][3];
+
+	// Return the next line without its newline, as a view into the current chunk or, if the
+	// line spans chunks, into the carry buffer. The view is valid until the next call.
+	// Return false at the end of the input.
+	bool getLine(StringView& line)
+	{
+		if (pos >= chunk.length) {
+			if (!stream.readChunk(chunk)) {
+				return false;
+			}
+			pos = 0;
+		}
+		const char* begin = chunk.bytes.data() + pos;
+		const auto* end =
+		    static_cast<const char*>(std::memchr(begin, '\n', chunk.length - pos));
+		if (end != nullptr) {
+			line = StringView(begin, end - begin);
+			pos += end - begin + 1;
+			return true;
+		}
+		carry.assign(begin, chunk.length - pos);
+		pos = chunk.length;
+		while (stream.readChunk(chunk)) {
+			begin = chunk.bytes.data();
+			end = static_cast<const char*>(std::memchr(begin, '\n', chunk.length));
+			if (end != nullptr) {
+				carry.append(begin, end - begin);
+				pos = end - begin + 1;
+				break;
+			}
+			carry.append(begin, chunk.length);
+			pos = chunk.length;
+		}
+		line = StringView(carry.data(), carry.size());
+		return true;
+	}
+
+	// Append s to the arena and return its extent.
+	static Extent append(std::vector<char>& arena, const char* s, size_t n)
+	{
+		Extent extent;
+		extent.offset = arena.size();
+		extent.size = n;
+		arena.insert(arena.end(), s, s + n);
+		return extent;
+	}
+
+	inline Extent
+	appendBarcode(std::vector<char>& arena, StringView id, StringView comment) const;
+	inline bool readRecord(std::vector<char>& arena, Extent (&extent)[3]);
+};
+
+// Extract the barcode of a read from its ID and comment, and append it to the arena.
+inline FastxParser::Extent
+FastxParser::appendBarcode(std::vector<char>& arena, StringView id, StringView comment) const
+{
+	if (comment.startsWith("BX:Z:")) {
+		const char* begin = comment.data + 5;
+		const auto* space = static_cast<const char*>(std::memchr(begin, ' ', comment.size - 5));
+		size_t n = space != nullptr ? space - begin : comment.size - 5;
+		return append(arena, begin, n);
+	}
+	if (fasta) {
+		// For FASTA, use the sequence ID.
+		return append(arena, id.data, id.size);
+	}
+	// No barcode tag is present. Check for stLFR barcode within read.id.
+	const auto* sharp = static_cast<const char*>(std::memchr(id.data, '#', id.size));
+	if (sharp != nullptr) {
+		const char* slash = nullptr;
+		for (const char* p = id.data + id.size; p > sharp + 1;) {
+			if (*--p == '/') {
+				slash = p;
+				break;
+			}
+		}
+		// Without a slash the barcode extends to the end of the ID.
+		const char* end = slash != nullptr ? slash : id.data + id.size;
+		if (slash != nullptr || std::memchr(id.data, '/', id.size) == nullptr) {
+			return append(arena, sharp + 1, end - sharp - 1);
+		}
+	}
+	return append(arena, "NA", 2);
+}
+
+// Read one record into the arena. Return false at the end of the input.
+inline bool
+FastxParser::readRecord(std::vector<char>& arena, Extent (&extent)[3])
+{
+	StringView line;
+	if (havePending) {
+		line = pending;
+		havePending = false;
+	} else {
+		// Skip to the next header line.
+		do {
+			if (!getLine(line)) {
+				return false;
+			}
+		} while (line.empty() || (line[0] != '>' && line[0] != '@'));
+	}
+
+	// The ID extends to the first white space, and the comment is the rest of the line.
+	size_t i = 1;
+	while (i < line.size && std::isspace(static_cast<unsigned char>(line[i])) == 0) {
+		++i;
+	}
+	StringView id(line.data + 1, i - 1);
+	StringView comment =
+	    i < line.size ? StringView(line.data + i + 1, line.size - i - 1) : StringView();
+	extent[0] = append(arena, id.data, id.size);
+	extent[1] = appendBarcode(arena, id, comment);
+
+	// The sequence may span several lines, and ends at the next header or the '+' line.
+	extent[2].offset = arena.size();
+	bool plus = false;
+	while (getLine(line)) {
+		if (line.empty()) {
+			continue;
+		}
+		if (line[0] == '>' || line[0] == '@') {
+			havePending = true;
+			pending = line;
+			break;
+		}
+		if (line[0] == '+') {
+			plus = true;
+			break;
+		}
+		arena.insert(arena.end(), line.data, line.data + line.size);
+	}
+	extent[2].size = arena.size() - extent[2].offset;
+	if (!plus) {
+		return true;
+	}
+
+	// Skip the quality, which may also span several lines.
+	size_t qualityLength = 0;
+	while (qualityLength < extent[2].size && getLine(line)) {
+		qualityLength += line.size;
+	}
+	if (qualityLength != extent[2].size) {
+		std::cerr << "physlr-indexlr: error: Quality and sequence lengths differ for read "
+		          << StringView(arena.data() + extent[0].offset, extent[0].size) << '\n';
+		exit(EXIT_FAILURE);
+	}
+	return true;
+}
+
+inline size_t
+FastxParser::readBlock(ReadBlock& block, size_t num)
+{
+	block.arena.clear();
+	block.dataCounter = 0;
+	block.pieces.reset();
+	while (block.dataCounter < BLOCK_SIZE && readRecord(block.arena, extents[block.dataCounter])) {
+		block.data[block.dataCounter].num = num + block.dataCounter;
+		++block.dataCounter;
+	}
+	// The arena has stopped growing, so its strings can now be referred to by pointer.
+	const char* arena = block.arena.data();
+	for (size_t i = 0; i < block.dataCounter; ++i) {
+		Read& read = block.data[i];
+		read.id = StringView(arena + extents[i][0].offset, extents[i][0].size);
+		read.barcode = StringView(arena + extents[i][1].offset, extents[i][1].size);
+		read.sequence = StringView(arena + extents[i][2].offset, extents[i][2].size);
+	}
+	block.num = num;
+	return block.dataCounter;
+}
+
+#endif
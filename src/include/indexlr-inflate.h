@@ -0,0 +1,380 @@
+#ifndef INDEXLR_INFLATE_H
+#define INDEXLR_INFLATE_H
+
+#include "indexlr-buffer.h"
+
+#include <zlib.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Size of the chunks of decompressed data handed to the parser
+const size_t CHUNK_BYTES = 1 << 18;
+// Number of chunks in flight between the reader, the inflate workers and the parser
+const size_t CHUNK_BUFFER_SIZE = 64;
+
+// A chunk of compressed or decompressed data, numbered in file order
+struct Chunk
+{
+	size_t num = 0;
+	std::vector<char> bytes;
+	size_t length = 0;
+
+	// Make room for at least n bytes without zeroing existing capacity on every reuse
+	void reserve(size_t n)
+	{
+		if (bytes.size() < n) {
+			bytes.resize(n);
+		}
+	}
+};
+
+// Read a file that is plain text, gzip or BGZF, and hand out its decompressed content in order.
+// BGZF blocks are inflated in parallel by several threads. Other gzip files, including
+// multi-member gzip, are inflated by a single thread, pipelined with the parser.
+class InflateStream
+{
+
+  public:
+	InflateStream(std::string ipath, unsigned threads)
+	  : ipath(std::move(ipath))
+	  , threads(std::max(threads, 1U))
+	  , compressed(CHUNK_BUFFER_SIZE)
+	  , decompressed(CHUNK_BUFFER_SIZE)
+	{
+		fp = std::fopen(this->ipath.c_str(), "rb");
+		if (fp == nullptr) {
+			std::cerr << "physlr-indexlr: error: " << std::strerror(errno) << ": " << this->ipath
+			          << '\n';
+			exit(EXIT_FAILURE);
+		}
+		reader = std::thread(doRead, this);
+	}
+
+	InflateStream(const InflateStream&) = delete;
+	InflateStream& operator=(const InflateStream&) = delete;
+
+	~InflateStream()
+	{
+		reader.join();
+		for (auto& t : inflaters) {
+			t.join();
+		}
+		std::fclose(fp);
+	}
+
+	// Copy up to len bytes of decompressed data into buf. Fill buf completely unless the end of
+	// the file is reached. Return the number of bytes copied.
+	size_t read(char* buf, size_t len)
+	{
+		size_t copied = 0;
+		while (copied < len && fill()) {
+			size_t n = std::min(len - copied, current.length - offset);
+			std::memcpy(buf + copied, current.bytes.data() + offset, n);
+			offset += n;
+			copied += n;
+		}
+		return copied;
+	}
+
+	// Return the next decompressed byte without consuming it, or EOF at the end of the file.
+	int peek() { return fill() ? static_cast<unsigned char>(current.bytes[offset]) : EOF; }
+
+	// Take the next non-empty chunk of decompressed data, handing the previous one back to
+	// the stream. Return false at the end of the file.
+	bool readChunk(Chunk& chunk)
+	{
+		if (!fill()) {
+			return false;
+		}
+		if (offset > 0) {
+			// Part of the current chunk was consumed by read or peek.
+			chunk.reserve(current.length - offset);
+			std::memcpy(chunk.bytes.data(), current.bytes.data() + offset, current.length - offset);
+			chunk.length = current.length - offset;
+			chunk.num = current.num;
+		} else {
+			std::swap(chunk, current);
+		}
+		offset = current.length = 0;
+		return true;
+	}
+
+  private:
+	const std::string ipath;
+	const unsigned threads;
+	std::FILE* fp = nullptr;
+	std::thread reader;
+	std::vector<std::thread> inflaters;
+	std::atomic<unsigned> runningInflaters{ 0 };
+	InputBuffer<Chunk> compressed;
+	OutputBuffer<Chunk> decompressed;
+	Chunk current;
+	size_t offset = 0;
+	bool eof = false;
+
+	// Make sure that the current chunk has unread data. Return false at the end of the file.
+	bool fill()
+	{
+		while (offset >= current.length) {
+			if (eof || !decompressed.read(current)) {
+				eof = true;
+				return false;
+			}
+			offset = 0;
+		}
+		return true;
+	}
+
+	[[noreturn]] void die(const std::string& msg) const
+	{
+		std::cerr << "physlr-indexlr: error: " << msg << ": " << ipath << '\n';
+		exit(EXIT_FAILURE);
+	}
+
+	// Read exactly n bytes. Return false at the end of the file.
+	bool readFully(char* buf, size_t n)
+	{
+		size_t got = std::fread(buf, 1, n, fp);
+		if (got == n) {
+			return true;
+		}
+		if (std::ferror(fp)) {
+			die(std::strerror(errno));
+		}
+		if (got > 0) {
+			die("Truncated input file");
+		}
+		return false;
+	}
+
+	static void doRead(InflateStream* stream) { stream->work(); }
+
+	static void doInflate(InflateStream* stream) { stream->inflateBlocks(); }
+
+	inline void work();
+	inline void readPlain(const unsigned char* head, size_t headLength);
+	inline void readGzip(const unsigned char* head, size_t headLength);
+	inline void readBgzf(const unsigned char* head, size_t headLength);
+	inline void inflateBlocks();
+};
+
+// Return the size of the BGZF block whose header starts at head, or 0 if it is not BGZF.
+static inline size_t
+bgzfBlockSize(const unsigned char* head, size_t headLength)
+{
+	const size_t FEXTRA = 4;
+	if (headLength < 12 || head[0] != 0x1f || head[1] != 0x8b || head[2] != Z_DEFLATED ||
+	    (head[3] & FEXTRA) == 0) {
+		return 0;
+	}
+	size_t xlen = head[10] | head[11] << 8U;
+	if (headLength < 12 + xlen) {
+		return 0;
+	}
+	for (size_t i = 12; i + 4 <= 12 + xlen;) {
+		size_t slen = head[i + 2] | head[i + 3] << 8U;
+		if (head[i] == 'B' && head[i + 1] == 'C' && slen == 2 && i + 6 <= 12 + xlen) {
+			return (head[i + 4] | head[i + 5] << 8U) + 1;
+		}
+		i += 4 + slen;
+	}
+	return 0;
+}
+
+inline void
+InflateStream::work()
+{
+	// A BGZF header is 18 bytes, which is also enough to recognize gzip.
+	const size_t BGZF_HEADER_BYTES = 18;
+	unsigned char head[BGZF_HEADER_BYTES];
+	size_t headLength = std::fread(head, 1, sizeof(head), fp);
+	if (headLength >= 2 && head[0] == 0x1f && head[1] == 0x8b) {
+		if (bgzfBlockSize(head, headLength) > 0) {
+			readBgzf(head, headLength);
+		} else {
+			readGzip(head, headLength);
+		}
+	} else {
+		readPlain(head, headLength);
+	}
+}
+
+// Pass uncompressed input through in chunks.
+inline void
+InflateStream::readPlain(const unsigned char* head, size_t headLength)
+{
+	Chunk chunk;
+	for (size_t num = 0;; ++num) {
+		chunk.reserve(CHUNK_BYTES);
+		std::memcpy(chunk.bytes.data(), head, headLength);
+		chunk.length = headLength + std::fread(chunk.bytes.data() + headLength, 1,
+		                                       CHUNK_BYTES - headLength, fp);
+		headLength = 0;
+		if (std::ferror(fp)) {
+			die(std::strerror(errno));
+		}
+		if (chunk.length == 0) {
+			break;
+		}
+		decompressed.write(chunk, num);
+	}
+	decompressed.close();
+}
+
+// Inflate gzip on this thread, one member after another, while the parser consumes the output.
+inline void
+InflateStream::readGzip(const unsigned char* head, size_t headLength)
+{
+	std::vector<unsigned char> in(CHUNK_BYTES);
+	std::memcpy(in.data(), head, headLength);
+	z_stream strm;
+	std::memset(&strm, 0, sizeof(strm));
+	// Decode the gzip header and trailer.
+	const int GZIP_WINDOW_BITS = 15 + 16;
+	if (inflateInit2(&strm, GZIP_WINDOW_BITS) != Z_OK) {
+		die("Failed to initialize zlib");
+	}
+	strm.next_in = in.data();
+	strm.avail_in = headLength;
+
+	Chunk chunk;
+	size_t num = 0;
+	size_t members = 0;
+	bool done = false;
+	while (!done) {
+		chunk.reserve(CHUNK_BYTES);
+		chunk.length = 0;
+		while (chunk.length < CHUNK_BYTES) {
+			if (strm.avail_in == 0) {
+				strm.avail_in = std::fread(in.data(), 1, in.size(), fp);
+				strm.next_in = in.data();
+				if (std::ferror(fp)) {
+					die(std::strerror(errno));
+				}
+				if (strm.avail_in == 0) {
+					done = true;
+					break;
+				}
+			}
+			strm.next_out = reinterpret_cast<unsigned char*>(chunk.bytes.data() + chunk.length);
+			strm.avail_out = CHUNK_BYTES - chunk.length;
+			int ret = inflate(&strm, Z_NO_FLUSH);
+			chunk.length = CHUNK_BYTES - strm.avail_out;
+			if (ret == Z_STREAM_END) {
+				// Continue with the next member of a multi-member gzip file.
+				++members;
+				inflateReset(&strm);
+			} else if (ret == Z_DATA_ERROR && members > 0 && strm.total_out == 0) {
+				// Ignore trailing garbage after the last member, as gzip does.
+				strm.total_in = 0;
+				done = true;
+				break;
+			} else if (ret != Z_OK && ret != Z_BUF_ERROR) {
+				die("Corrupt gzip data");
+			}
+		}
+		if (chunk.length > 0) {
+			decompressed.write(chunk, num++);
+		}
+	}
+	if (strm.total_in > 0) {
+		// The input ended in the middle of a member.
+		die("Truncated gzip file");
+	}
+	inflateEnd(&strm);
+	decompressed.close();
+}
+
+// Split BGZF into its blocks on this thread, and inflate them on the inflate workers.
+inline void
+InflateStream::readBgzf(const unsigned char* head, size_t headLength)
+{
+	runningInflaters = threads;
+	for (unsigned i = 0; i < threads; ++i) {
+		inflaters.emplace_back(doInflate, this);
+	}
+	const size_t BGZF_HEADER_BYTES = 18;
+	bool first = true;
+	for (size_t num = 0;; ++num) {
+		Chunk& block = compressed.getWriteAccess();
+		block.reserve(BGZF_HEADER_BYTES);
+		if (first) {
+			std::memcpy(block.bytes.data(), head, headLength);
+			first = false;
+		} else if (!readFully(block.bytes.data(), BGZF_HEADER_BYTES)) {
+			break;
+		}
+		auto* header = reinterpret_cast<unsigned char*>(block.bytes.data());
+		size_t blockSize = bgzfBlockSize(header, BGZF_HEADER_BYTES);
+		if (blockSize < BGZF_HEADER_BYTES) {
+			die("Expected a BGZF block");
+		}
+		block.reserve(blockSize);
+		if (!readFully(block.bytes.data() + BGZF_HEADER_BYTES, blockSize - BGZF_HEADER_BYTES)) {
+			die("Truncated BGZF file");
+		}
+		block.length = blockSize;
+		block.num = num;
+		compressed.releaseWriteAccess();
+	}
+	compressed.close();
+}
+
+// Inflate BGZF blocks in parallel. The last worker to finish closes the output.
+inline void
+InflateStream::inflateBlocks()
+{
+	// Size of the gzip trailer: CRC32 and ISIZE
+	const size_t TRAILER_BYTES = 8;
+	// Decode raw deflate data.
+	const int RAW_WINDOW_BITS = -15;
+	z_stream strm;
+	std::memset(&strm, 0, sizeof(strm));
+	if (inflateInit2(&strm, RAW_WINDOW_BITS) != Z_OK) {
+		die("Failed to initialize zlib");
+	}
+	Chunk block;
+	Chunk chunk;
+	while (compressed.read(block)) {
+		const auto* bytes = reinterpret_cast<const unsigned char*>(block.bytes.data());
+		size_t xlen = bytes[10] | bytes[11] << 8U;
+		size_t dataOffset = 12 + xlen;
+		if (block.length < dataOffset + TRAILER_BYTES) {
+			die("Corrupt BGZF block");
+		}
+		const unsigned char* trailer = bytes + block.length - TRAILER_BYTES;
+		uint32_t crc = trailer[0] | trailer[1] << 8U | trailer[2] << 16U |
+		               static_cast<uint32_t>(trailer[3]) << 24U;
+		size_t isize = trailer[4] | trailer[5] << 8U | trailer[6] << 16U |
+		               static_cast<uint32_t>(trailer[7]) << 24U;
+
+		chunk.reserve(std::max<size_t>(isize, 1));
+		inflateReset(&strm);
+		strm.next_in = const_cast<unsigned char*>(bytes + dataOffset);
+		strm.avail_in = block.length - dataOffset - TRAILER_BYTES;
+		strm.next_out = reinterpret_cast<unsigned char*>(chunk.bytes.data());
+		strm.avail_out = isize;
+		int ret = inflate(&strm, Z_FINISH);
+		if (ret != Z_STREAM_END || strm.avail_out != 0 ||
+		    crc32(0, reinterpret_cast<const unsigned char*>(chunk.bytes.data()), isize) != crc) {
+			die("Corrupt BGZF block");
+		}
+		chunk.length = isize;
+		decompressed.write(chunk, block.num);
+	}
+	inflateEnd(&strm);
+	if (--runningInflaters == 0) {
+		decompressed.close();
+	}
+}
+
+#endif
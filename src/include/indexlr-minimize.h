@@ -4,7 +4,7 @@
 // ntHash 2.0.0
 #include "IOUtil.h"
 #include "btl_bloomfilter/BloomFilter.hpp"
-#include "ntHashIterator.h"
+#include "indexlr-nthash.h"
 #include "nthash.h"
 
 #include <algorithm>
@@ -14,15 +14,6 @@
 #include <string>
 #include <vector>
 
-// Return true if the second string is a prefix of the string s.
-template<size_t N>
-static inline bool
-startsWith(const std::string& s, const char (&prefix)[N])
-{
-	auto n = N - 1;
-	return s.size() > n && equal(s.begin(), s.begin() + n, prefix);
-}
-
 struct HashData
 {
 	HashData(uint64_t hash1, uint64_t hash2, size_t pos, char strand)
@@ -36,83 +27,156 @@ struct HashData
 	char strand;
 };
 
-using HashValues = std::vector<HashData>;
+// Hash the k-mers of sequences with ntHash, using the SIMD instruction set chosen by
+// selectRollNtHash. The hash values are identical for every instruction set.
+class KmerHasher
+{
+
+  public:
+	KmerHasher(size_t k, RollNtHash roll)
+	  : k(k)
+	  , roll(roll)
+	  , tables(k)
+	  , fwd(TILE_SIZE)
+	  , rev(TILE_SIZE)
+	  , scratch(rollNtHashScratchSize(TILE_SIZE))
+	{}
+
+	// Call f(hash) with the hashes of each k-mer of a sequence in order, skipping k-mers that
+	// contain non-ACGT characters. Return the number of k-mers hashed.
+	template<typename F>
+	size_t forEach(const char* seq, size_t length, F f);
 
-// Hash the k-mers of a read using ntHash.
-static inline HashValues
-hashKmers(const std::string& readstr, const size_t k)
+  private:
+	// The number of k-mers hashed at once, which keeps the hash values in the L1 cache
+	static const size_t TILE_SIZE = 2048;
+
+	const size_t k;
+	const RollNtHash roll;
+	const NtHashTables tables;
+	std::vector<uint64_t> fwd;
+	std::vector<uint64_t> rev;
+	std::vector<uint64_t> scratch;
+};
+
+template<typename F>
+inline size_t
+KmerHasher::forEach(const char* seq, const size_t length, F f)
 {
-	HashValues hashes;
-	if (readstr.size() < k) {
-		return hashes;
+	if (length < k) {
+		return 0;
 	}
-	hashes.reserve(readstr.size() - k + 1);
-	for (ntHashIterator iter(readstr, 2, k); iter != ntHashIterator::end(); ++iter) {
-		hashes.push_back(HashData((*iter)[0], (*iter)[1], iter.pos(), iter.strand()));
+	const size_t nkmers = length - k + 1;
+	// A k-mer is valid when it starts after the last non-ACGT character it covers.
+	size_t validFrom = 0;
+	for (size_t i = 0; i + 1 < k; ++i) {
+		if (seedTab[static_cast<unsigned char>(seq[i])] == seedN) {
+			validFrom = i + 1;
+		}
 	}
-	return hashes;
+	size_t count = 0;
+	for (size_t tile = 0; tile < nkmers; tile += TILE_SIZE) {
+		const size_t n = nkmers - tile < TILE_SIZE ? nkmers - tile : TILE_SIZE;
+		roll(seq + tile, n, k, tables, fwd.data(), rev.data(), scratch.data());
+		for (size_t i = 0; i < n; ++i) {
+			const size_t pos = tile + i;
+			if (seedTab[static_cast<unsigned char>(seq[pos + k - 1])] == seedN) {
+				validFrom = pos + k;
+			}
+			if (pos < validFrom) {
+				continue;
+			}
+			// As the canonical multi-hash NTMC64 with two hashes
+			const uint64_t fh = fwd[i], rh = rev[i];
+			const uint64_t hash1 = rh < fh ? rh : fh;
+			uint64_t hash2 = hash1 * (1 ^ k * multiSeed);
+			hash2 ^= hash2 >> multiShift;
+			f(HashData(hash1, hash2, pos, fh <= rh ? '+' : '-'));
+			++count;
+		}
+	}
+	return count;
 }
 
-// Minimerize a sequence: Find the minimizers of a vector of hash values representing a sequence.
+// Minimerize a stream of hash values: find the hash with the minimum hash1 in each window of w
+// consecutive hashes, preferring the right-most on ties, and report it once when it changes.
 /* Algorithm
-v is a vector of non-negative integers
-w is the window size
-Invariants
-    0 <  w <= v.size() - 1
-    0 <= l <= r <= v.size() - 1
-Initial conditions
-    M    = NIL       Final set of minimizers, empty initially
-    min  = -1        Minimum element
-    i    = -1        Index of minimum element
-    prev = -1        Index of previous minimum element
-    l    = 0         Index of left end of window
-    r    = l + w - 1 Index of right end of window
-Computation
-At each window, if the previous minimum is out of scope, find the new, right-most, minimum
-or else, check with only the right-most element to determine if that is the new minimum.
-A minimizer is added to the final vector only if it's index has changed.
-for each window of v bounded by [l, r]
-    if (i < l)
-        i = index of minimum element in [l, r], furthest from l.
-    else if (v[r] <= v[i])
-        i = r
-    min = v[i]
-    if (i != prev) {
-        prev = i
-        M <- M + m
-    }
-    l = l + 1        Move window's left bound by one element
-    r = l + w - 1    Set window's right bound
-}*/
-
-static inline HashValues
-getMinimizers(const HashValues& hashes, const unsigned w)
+The window minimum is kept in a monotone deque of the hashes that may still become the minimum
+of a later window: their hash1 values increase strictly from front to back.
+for each hash v[r]
+    pop hashes from the back while their hash1 >= v[r].hash1     The right-most minimum wins.
+    push v[r] to the back
+    pop the front if it is left of the window [r - w + 1, r]
+    if r >= w - 1 and the front is not the previous minimizer
+        report the front as a minimizer
+Each hash is pushed and popped at most once, so the cost is O(1) amortized per hash.
+*/
+class WindowMinimizer
 {
-	HashValues minimizers;
-	if (hashes.size() < w) {
-		return minimizers;
+
+  public:
+	explicit WindowMinimizer(size_t w)
+	  : w(w)
+	  , deque(ringSize(w + 1))
+	  , mask(deque.size() - 1)
+	{}
+
+	// Start a new sequence.
+	void reset()
+	{
+		head = tail = 0;
+		count = 0;
+		prev = 0;
 	}
-	minimizers.reserve(2 * hashes.size() / w);
-	int i = -1, prev = -1;
-	auto firstIt = hashes.begin();
-	auto minIt = hashes.end();
-	for (auto leftIt = firstIt; leftIt < hashes.end() - w + 1; ++leftIt) {
-		auto rightIt = leftIt + w;
-		if (i < leftIt - firstIt) {
-			// Use of operator '<=' returns the minimum that is furthest from left.
-			minIt = std::min_element(leftIt, rightIt, [](const HashData& a, const HashData& b) {
-				return a.hash1 <= b.hash1;
-			});
-		} else if (rightIt[-1].hash1 <= minIt->hash1) {
-			minIt = rightIt - 1;
+
+	// Add the next hash of the sequence, and call emit(minimizer) for a new minimizer.
+	template<typename Emit>
+	void push(const HashData& hash, Emit emit)
+	{
+		while (tail > head && at(tail - 1).hash.hash1 >= hash.hash1) {
+			--tail;
+		}
+		Entry& back = at(tail++);
+		back.hash = hash;
+		back.index = count++;
+		if (at(head).index + w < count) {
+			++head;
 		}
-		i = minIt - firstIt;
-		if (i > prev) {
-			prev = i;
-			minimizers.push_back(*minIt);
+		// prev is one past the index of the previous minimizer.
+		if (count >= w && at(head).index >= prev) {
+			prev = at(head).index + 1;
+			emit(static_cast<const HashData&>(at(head).hash));
 		}
 	}
-	return minimizers;
-}
+
+  private:
+	struct Entry
+	{
+		HashData hash{ 0, 0, 0, 0 };
+		size_t index = 0;
+	};
+
+	const size_t w;
+	// A ring buffer of the entries in the window and the one that just left it, whose size is a
+	// power of two, so that an index wraps around with a mask rather than a division
+	std::vector<Entry> deque;
+	const size_t mask;
+	size_t head = 0;
+	size_t tail = 0;
+	size_t count = 0;
+	size_t prev = 0;
+
+	Entry& at(size_t i) { return deque[i & mask]; }
+
+	static size_t ringSize(size_t n)
+	{
+		size_t size = 1;
+		while (size < n) {
+			size *= 2;
+		}
+		return size;
+	}
+};
 
 #endif
+
@@ -0,0 +1,287 @@
+#ifndef INDEXLR_NTHASH_H
+#define INDEXLR_NTHASH_H
+
+// ntHash 2.0.0
+#include "nthash.h"
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#define INDEXLR_X86_SIMD 1
+#include <immintrin.h>
+#endif
+
+// Rolling ntHash with several lanes in SIMD registers.
+// A run of k-mers is split into one contiguous segment per lane, and the lanes roll in lockstep.
+// ntHash is linear in the seeds of the characters, so rolling across a non-ACGT character gives
+// the same value as hashing the k-mer from scratch. The caller skips the k-mers that contain one.
+
+// The seeds of the characters entering and leaving a k-mer, for a fixed k
+struct NtHashTables
+{
+	explicit NtHashTables(unsigned k)
+	{
+		for (unsigned c = 0; c < 256; ++c) {
+			unsigned rc = c & cpOff;
+			fwdIn[c] = seedTab[c];
+			fwdOut[c] = msTab31l[c][k % 31] | msTab33r[c][k % 33];
+			revIn[c] = msTab31l[rc][k % 31] | msTab33r[rc][k % 33];
+			revOut[c] = seedTab[rc];
+		}
+	}
+
+	uint64_t fwdIn[256];
+	uint64_t fwdOut[256];
+	uint64_t revIn[256];
+	uint64_t revOut[256];
+};
+
+// Compute the forward and reverse ntHash of the n k-mers starting at seq.
+using RollNtHash = void (*)(
+    const char* seq,
+    size_t n,
+    unsigned k,
+    const NtHashTables& tables,
+    uint64_t* fwd,
+    uint64_t* rev,
+    uint64_t* scratch);
+
+// The number of values of scratch space needed by a RollNtHash for n k-mers
+static inline size_t
+rollNtHashScratchSize(size_t n)
+{
+	return 2 * n;
+}
+
+static inline void
+rollNtHashScalar(
+    const char* seq,
+    size_t n,
+    unsigned k,
+    const NtHashTables& tables,
+    uint64_t* fwd,
+    uint64_t* rev,
+    uint64_t* /*scratch*/)
+{
+	if (n == 0) {
+		return;
+	}
+	uint64_t fh = NTF64(seq, k);
+	uint64_t rh = NTR64(seq, k);
+	fwd[0] = fh;
+	rev[0] = rh;
+	for (size_t i = 1; i < n; ++i) {
+		auto out = static_cast<unsigned char>(seq[i - 1]);
+		auto in = static_cast<unsigned char>(seq[i - 1 + k]);
+		fh = swapbits033(rol1(fh)) ^ tables.fwdIn[in] ^ tables.fwdOut[out];
+		rh = swapbits3263(ror1(rh ^ tables.revIn[in] ^ tables.revOut[out]));
+		fwd[i] = fh;
+		rev[i] = rh;
+	}
+}
+
+#if INDEXLR_X86_SIMD
+
+// Hash the first k-mer of each of the lanes of s k-mers.
+static inline void
+initLanes(const char* seq, size_t lanes, size_t s, unsigned k, uint64_t* fh, uint64_t* rh)
+{
+	for (size_t j = 0; j < lanes; ++j) {
+		fh[j] = NTF64(seq + j * s, k);
+		rh[j] = NTR64(seq + j * s, k);
+	}
+}
+
+// Reorder lane-interleaved hash values into sequence order, and hash the k-mers past the last
+// lane with the scalar code.
+static inline void
+finishLanes(
+    const char* seq,
+    size_t n,
+    unsigned k,
+    const NtHashTables& tables,
+    size_t lanes,
+    size_t s,
+    uint64_t* fwd,
+    uint64_t* rev,
+    const uint64_t* scratch)
+{
+	const uint64_t* fwdLanes = scratch;
+	const uint64_t* revLanes = scratch + lanes * s;
+	for (size_t j = 0; j < lanes; ++j) {
+		for (size_t i = 0; i < s; ++i) {
+			fwd[j * s + i] = fwdLanes[i * lanes + j];
+			rev[j * s + i] = revLanes[i * lanes + j];
+		}
+	}
+	rollNtHashScalar(
+	    seq + lanes * s, n - lanes * s, k, tables, fwd + lanes * s, rev + lanes * s, nullptr);
+}
+
+// Look up the seeds of the characters p[0], p[s], p[2s] and p[3s].
+__attribute__((target("avx2"))) static inline __m256i
+gatherAvx2(const uint64_t* table, const char* p, size_t s)
+{
+	__m256i index = _mm256_set_epi64x(
+	    static_cast<unsigned char>(p[3 * s]),
+	    static_cast<unsigned char>(p[2 * s]),
+	    static_cast<unsigned char>(p[s]),
+	    static_cast<unsigned char>(p[0]));
+	return _mm256_i64gather_epi64(reinterpret_cast<const long long*>(table), index, 8);
+}
+
+// Roll four lanes of ntHash with AVX2.
+__attribute__((target("avx2"))) static void
+rollNtHashAvx2(
+    const char* seq,
+    size_t n,
+    unsigned k,
+    const NtHashTables& tables,
+    uint64_t* fwd,
+    uint64_t* rev,
+    uint64_t* scratch)
+{
+	const size_t lanes = 4;
+	size_t s = n / lanes;
+	if (s < 2) {
+		rollNtHashScalar(seq, n, k, tables, fwd, rev, scratch);
+		return;
+	}
+	uint64_t* fwdLanes = scratch;
+	uint64_t* revLanes = scratch + lanes * s;
+	initLanes(seq, lanes, s, k, fwdLanes, revLanes);
+	const __m256i one = _mm256_set1_epi64x(1);
+	__m256i fh = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(fwdLanes));
+	__m256i rh = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(revLanes));
+	for (size_t i = 1; i < s; ++i) {
+		const char* out = seq + i - 1;
+		const char* in = seq + i - 1 + k;
+		// fh = swapbits033(rol1(fh)) ^ fwdIn[in] ^ fwdOut[out]
+		fh = _mm256_or_si256(_mm256_slli_epi64(fh, 1), _mm256_srli_epi64(fh, 63));
+		__m256i x = _mm256_and_si256(_mm256_xor_si256(fh, _mm256_srli_epi64(fh, 33)), one);
+		fh = _mm256_xor_si256(fh, _mm256_or_si256(x, _mm256_slli_epi64(x, 33)));
+		fh = _mm256_xor_si256(
+		    fh,
+		    _mm256_xor_si256(
+		        gatherAvx2(tables.fwdIn, in, s), gatherAvx2(tables.fwdOut, out, s)));
+		// rh = swapbits3263(ror1(rh ^ revIn[in] ^ revOut[out]))
+		rh = _mm256_xor_si256(
+		    rh,
+		    _mm256_xor_si256(
+		        gatherAvx2(tables.revIn, in, s), gatherAvx2(tables.revOut, out, s)));
+		rh = _mm256_or_si256(_mm256_srli_epi64(rh, 1), _mm256_slli_epi64(rh, 63));
+		x = _mm256_and_si256(
+		    _mm256_xor_si256(_mm256_srli_epi64(rh, 32), _mm256_srli_epi64(rh, 63)), one);
+		rh = _mm256_xor_si256(
+		    rh, _mm256_or_si256(_mm256_slli_epi64(x, 32), _mm256_slli_epi64(x, 63)));
+		_mm256_storeu_si256(reinterpret_cast<__m256i*>(fwdLanes + i * lanes), fh);
+		_mm256_storeu_si256(reinterpret_cast<__m256i*>(revLanes + i * lanes), rh);
+	}
+	finishLanes(seq, n, k, tables, lanes, s, fwd, rev, scratch);
+}
+
+// GCC 12 warns of the undefined pass-through operand in its own AVX-512 intrinsics.
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wmaybe-uninitialized"
+
+// Look up the seeds of the characters p[0], p[s], ..., p[7s].
+__attribute__((target("avx512f"))) static inline __m512i
+gatherAvx512(const uint64_t* table, const char* p, size_t s)
+{
+	__m512i index = _mm512_set_epi64(
+	    static_cast<unsigned char>(p[7 * s]),
+	    static_cast<unsigned char>(p[6 * s]),
+	    static_cast<unsigned char>(p[5 * s]),
+	    static_cast<unsigned char>(p[4 * s]),
+	    static_cast<unsigned char>(p[3 * s]),
+	    static_cast<unsigned char>(p[2 * s]),
+	    static_cast<unsigned char>(p[s]),
+	    static_cast<unsigned char>(p[0]));
+	return _mm512_i64gather_epi64(index, table, 8);
+}
+
+// Roll eight lanes of ntHash with AVX-512.
+__attribute__((target("avx512f"))) static void
+rollNtHashAvx512(
+    const char* seq,
+    size_t n,
+    unsigned k,
+    const NtHashTables& tables,
+    uint64_t* fwd,
+    uint64_t* rev,
+    uint64_t* scratch)
+{
+	// Exclusive or of three operands with _mm512_ternarylogic_epi64
+	const int XOR3 = 0x96;
+	const size_t lanes = 8;
+	size_t s = n / lanes;
+	if (s < 2) {
+		rollNtHashScalar(seq, n, k, tables, fwd, rev, scratch);
+		return;
+	}
+	uint64_t* fwdLanes = scratch;
+	uint64_t* revLanes = scratch + lanes * s;
+	initLanes(seq, lanes, s, k, fwdLanes, revLanes);
+	const __m512i one = _mm512_set1_epi64(1);
+	__m512i fh = _mm512_loadu_si512(fwdLanes);
+	__m512i rh = _mm512_loadu_si512(revLanes);
+	for (size_t i = 1; i < s; ++i) {
+		const char* out = seq + i - 1;
+		const char* in = seq + i - 1 + k;
+		// fh = swapbits033(rol1(fh)) ^ fwdIn[in] ^ fwdOut[out]
+		fh = _mm512_rol_epi64(fh, 1);
+		__m512i x = _mm512_and_si512(_mm512_xor_si512(fh, _mm512_srli_epi64(fh, 33)), one);
+		fh = _mm512_ternarylogic_epi64(fh, x, _mm512_slli_epi64(x, 33), XOR3);
+		fh = _mm512_ternarylogic_epi64(
+		    fh, gatherAvx512(tables.fwdIn, in, s), gatherAvx512(tables.fwdOut, out, s), XOR3);
+		// rh = swapbits3263(ror1(rh ^ revIn[in] ^ revOut[out]))
+		rh = _mm512_ternarylogic_epi64(
+		    rh, gatherAvx512(tables.revIn, in, s), gatherAvx512(tables.revOut, out, s), XOR3);
+		rh = _mm512_ror_epi64(rh, 1);
+		x = _mm512_and_si512(
+		    _mm512_xor_si512(_mm512_srli_epi64(rh, 32), _mm512_srli_epi64(rh, 63)), one);
+		rh = _mm512_ternarylogic_epi64(
+		    rh, _mm512_slli_epi64(x, 32), _mm512_slli_epi64(x, 63), XOR3);
+		_mm512_storeu_si512(fwdLanes + i * lanes, fh);
+		_mm512_storeu_si512(revLanes + i * lanes, rh);
+	}
+	finishLanes(seq, n, k, tables, lanes, s, fwd, rev, scratch);
+}
+
+#pragma GCC diagnostic pop
+
+#endif
+
+// Return the rolling hash function for the named instruction set, one of auto, scalar, avx2
+// and avx512. auto picks the widest one supported by this CPU. Return nullptr for an unknown
+// name, and fall back to auto if the instruction set is not supported.
+static inline RollNtHash
+selectRollNtHash(const std::string& simd = "auto")
+{
+	if (simd == "scalar") {
+		return rollNtHashScalar;
+	}
+	if (simd != "auto" && simd != "avx2" && simd != "avx512") {
+		return nullptr;
+	}
+#if INDEXLR_X86_SIMD
+	__builtin_cpu_init();
+	bool avx512 = __builtin_cpu_supports("avx512f") != 0;
+	bool avx2 = __builtin_cpu_supports("avx2") != 0;
+	if (simd == "avx2" && avx2) {
+		return rollNtHashAvx2;
+	}
+	if (avx512 && (simd == "avx512" || simd == "auto")) {
+		return rollNtHashAvx512;
+	}
+	if (avx2 && (simd == "auto" || simd == "avx512")) {
+		return rollNtHashAvx2;
+	}
+#endif
+	return rollNtHashScalar;
+}
+
+#endif
@@ -0,0 +1,103 @@
+#ifndef INDEXLR_SKETCH_H
+#define INDEXLR_SKETCH_H
+
+#include "btl_bloomfilter/CountingBloomFilter.hpp"
+#include "indexlr-minimize.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <limits>
+#include <vector>
+
+// Find the first local minimum of a histogram of counts, where hist[c] is the number of
+// elements counted c times, and the mode after it, as physlr find-ntcard-mode does.
+static inline void
+findHistogramMode(const std::vector<uint64_t>& hist, unsigned& minimum, unsigned& mode)
+{
+	minimum = 1;
+	for (unsigned c = 2; c < hist.size(); ++c) {
+		if (hist[c] > hist[c - 1]) {
+			minimum = c - 1;
+			break;
+		}
+	}
+	mode = minimum;
+	for (unsigned c = minimum; c < hist.size(); ++c) {
+		if (hist[c] > hist[mode]) {
+			mode = c;
+		}
+	}
+}
+
+// Count the occurrences of minimizers in a first pass over the reads, and keep in a second pass
+// the minimizers counted at least the solid threshold and fewer than the repeat threshold.
+// The counts are a count-min sketch, indexed by the two hash values of a minimizer, so that a count
+// is never underestimated. Both counters are incremented, rather than only the least as in a
+// conservative update, so that the counts do not depend on the order in which the threads add
+// them. Counts saturate at 255.
+class MinimizerSketch
+{
+
+  public:
+	// Counts saturate at this count, so a threshold may be at most this count.
+	static const unsigned MAX_COUNT = std::numeric_limits<uint8_t>::max();
+
+	explicit MinimizerSketch(size_t bytes)
+	  : counts(bytes, 2, 0, 0)
+	{}
+
+	// Whether the minimizers are being counted rather than filtered
+	bool isCounting() const { return counting; }
+
+	// Count an occurrence of a minimizer. Thread safe.
+	void add(const HashData& m)
+	{
+		const uint64_t hashes[] = { m.hash1, m.hash2 };
+		counts.incrementAll(hashes);
+	}
+
+	// Return whether to keep a minimizer once counting is finished.
+	bool keep(const HashData& m) const
+	{
+		const uint64_t hashes[] = { m.hash1, m.hash2 };
+		unsigned count = counts.minCount(hashes);
+		return count >= solidThreshold && count < repeatThreshold;
+	}
+
+	// Stop counting and set the thresholds. A threshold of zero is found from the histogram of
+	// the counters: the repeat threshold is three times the mode, and the solid threshold is the
+	// first local minimum.
+	void finish(unsigned repeat, unsigned solid)
+	{
+		// Most counters are zero, so count them in a register rather than in the histogram.
+		std::vector<uint64_t> hist(MAX_COUNT + 1);
+		uint64_t zeros = 0;
+		for (size_t i = 0; i < counts.size(); ++i) {
+			uint8_t count = counts[i];
+			if (count == 0) {
+				++zeros;
+			} else {
+				++hist[count];
+			}
+		}
+		hist[0] = zeros;
+		unsigned minimum = 0;
+		findHistogramMode(hist, minimum, mode);
+		repeatThreshold = repeat != 0 ? repeat : std::min(3 * mode, unsigned(MAX_COUNT));
+		solidThreshold = solid != 0 ? solid : minimum;
+		counting = false;
+	}
+
+	unsigned getMode() const { return mode; }
+	unsigned getRepeatThreshold() const { return repeatThreshold; }
+	unsigned getSolidThreshold() const { return solidThreshold; }
+
+  private:
+	CountingBloomFilter<uint8_t> counts;
+	bool counting = true;
+	unsigned mode = 0;
+	unsigned repeatThreshold = 0;
+	unsigned solidThreshold = 0;
+};
+
+#endif
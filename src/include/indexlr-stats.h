@@ -0,0 +1,295 @@
+#ifndef INDEXLR_STATS_H
+#define INDEXLR_STATS_H
+
+#include "indexlr-buffer.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+// The counters of a thread of the pipeline
+enum Counter
+{
+	COUNTER_BLOCKS,
+	COUNTER_READS,
+	COUNTER_BASES,
+	COUNTER_KMERS,
+	COUNTER_MINIMIZERS,
+	COUNTER_REPEAT_QUERIES,
+	COUNTER_SOLID_QUERIES,
+	COUNTER_BYTES,
+	COUNTER_BUSY_NANOSECONDS,
+	COUNTERS
+};
+
+static const char* const COUNTER_NAMES[COUNTERS] = { "blocks",         "reads",
+	                                                 "bases",          "kmers",
+	                                                 "minimizers",     "repeat_queries",
+	                                                 "solid_queries",  "bytes",
+	                                                 "busy_nanoseconds" };
+
+// The counts of a thread since they were last added to its counters
+struct StageCounts
+{
+	uint64_t values[COUNTERS] = {};
+
+	uint64_t& operator[](Counter c) { return values[c]; }
+
+	// Add the time since start to the busy time, and return the time now.
+	std::chrono::steady_clock::time_point addBusy(std::chrono::steady_clock::time_point start)
+	{
+		auto now = std::chrono::steady_clock::now();
+		values[COUNTER_BUSY_NANOSECONDS] +=
+		    std::chrono::duration_cast<std::chrono::nanoseconds>(now - start).count();
+		return now;
+	}
+};
+
+// The counters of a thread, which it adds its counts to once per block so that another thread
+// may read them while it runs
+struct StageCounters
+{
+	std::atomic<uint64_t> values[COUNTERS];
+
+	StageCounters()
+	{
+		for (auto& value : values) {
+			value.store(0, std::memory_order_relaxed);
+		}
+	}
+
+	StageCounters(const StageCounters&) = delete;
+	StageCounters& operator=(const StageCounters&) = delete;
+
+	// Add the counts to the counters and clear them.
+	void add(StageCounts& counts)
+	{
+		for (size_t i = 0; i < COUNTERS; ++i) {
+			if (counts.values[i] != 0) {
+				values[i].fetch_add(counts.values[i], std::memory_order_relaxed);
+				counts.values[i] = 0;
+			}
+		}
+	}
+
+	uint64_t get(Counter c) const { return values[c].load(std::memory_order_relaxed); }
+};
+
+// The counters of the threads of the pipeline of physlr-indexlr and the occupancy of its
+// buffers, which are reported as JSON to stderr when the pipeline finishes, and with an interval,
+// as one line of JSON per interval while it runs.
+class PipelineStats
+{
+
+  public:
+	PipelineStats(size_t inputThreads, size_t minimizeThreads)
+	  : input(inputThreads)
+	  , minimize(minimizeThreads)
+	  , output(1)
+	{}
+
+	PipelineStats(const PipelineStats&) = delete;
+	PipelineStats& operator=(const PipelineStats&) = delete;
+
+	~PipelineStats() { stop(); }
+
+	// The counters of the threads of each stage
+	std::vector<StageCounters> input;
+	std::vector<StageCounters> minimize;
+	std::vector<StageCounters> output;
+
+	// Sample the occupancy of a buffer.
+	template<typename T>
+	void watch(const std::string& name, const Buffer<T>& buffer)
+	{
+		BufferSamples samples;
+		samples.name = name;
+		samples.capacity = buffer.getCapacity();
+		samples.full = &buffer.getFullWaits();
+		samples.empty = &buffer.getEmptyWaits();
+		samples.elements = [&buffer]() { return buffer.elements(); };
+		buffers.push_back(samples);
+	}
+
+	// Start sampling the buffers, and report progress every interval seconds, unless zero.
+	void start(double interval)
+	{
+		this->interval = interval;
+		begin = std::chrono::steady_clock::now();
+		t = std::thread(doSample, this);
+	}
+
+	// Stop sampling the buffers.
+	void stop()
+	{
+		if (!t.joinable()) {
+			return;
+		}
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			stopped = true;
+		}
+		stopping.notify_one();
+		t.join();
+	}
+
+	// Write the counters of every thread and the statistics of every buffer as JSON.
+	inline void write(std::ostream& os, const std::string& pass) const;
+
+  private:
+	// Buffers are sampled this often.
+	static const unsigned SAMPLE_MILLISECONDS = 10;
+
+	struct BufferSamples
+	{
+		std::string name;
+		size_t capacity = 0;
+		const WaitStats* full = nullptr;
+		const WaitStats* empty = nullptr;
+		std::function<size_t()> elements;
+		uint64_t samples = 0;
+		uint64_t sum = 0;
+		size_t max = 0;
+	};
+
+	std::vector<BufferSamples> buffers;
+	double interval = 0;
+	std::chrono::steady_clock::time_point begin;
+	std::mutex mutex;
+	std::condition_variable stopping;
+	bool stopped = false;
+
+	double elapsed() const
+	{
+		return std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+	}
+
+	static uint64_t sum(const std::vector<StageCounters>& stage, Counter c)
+	{
+		uint64_t total = 0;
+		for (const auto& counters : stage) {
+			total += counters.get(c);
+		}
+		return total;
+	}
+
+	inline void sample();
+	inline void writeProgress(double seconds, uint64_t& lastReads, double& lastSeconds) const;
+	static inline void writeStage(
+	    std::ostream& os,
+	    const std::string& name,
+	    const std::vector<StageCounters>& stage,
+	    double seconds);
+
+	static void doSample(PipelineStats* stats) { stats->sample(); }
+
+	std::thread t;
+};
+
+inline void
+PipelineStats::sample()
+{
+	uint64_t lastReads = 0;
+	double lastSeconds = 0;
+	double nextReport = interval;
+	std::unique_lock<std::mutex> lock(mutex);
+	while (!stopping.wait_for(
+	    lock, std::chrono::milliseconds(SAMPLE_MILLISECONDS), [this] { return stopped; })) {
+		for (auto& samples : buffers) {
+			size_t elements = samples.elements();
+			++samples.samples;
+			samples.sum += elements;
+			samples.max = std::max(samples.max, elements);
+		}
+		double seconds = elapsed();
+		if (interval > 0 && seconds >= nextReport) {
+			writeProgress(seconds, lastReads, lastSeconds);
+			nextReport += interval;
+		}
+	}
+}
+
+// Write one line of the reads minimized so far and the occupancy of the buffers now.
+inline void
+PipelineStats::writeProgress(double seconds, uint64_t& lastReads, double& lastSeconds) const
+{
+	uint64_t reads = sum(minimize, COUNTER_READS);
+	std::ostringstream ss;
+	ss << std::fixed << std::setprecision(3) << "{\"elapsed_seconds\": " << seconds
+	   << ", \"reads\": " << reads << ", \"bases\": " << sum(minimize, COUNTER_BASES)
+	   << ", \"reads_per_second\": " << (reads - lastReads) / (seconds - lastSeconds);
+	for (const auto& samples : buffers) {
+		ss << ", \"" << samples.name << "_occupancy\": " << samples.elements();
+	}
+	ss << "}\n";
+	std::cerr << ss.str();
+	lastReads = reads;
+	lastSeconds = seconds;
+}
+
+inline void
+PipelineStats::writeStage(
+    std::ostream& os,
+    const std::string& name,
+    const std::vector<StageCounters>& stage,
+    double seconds)
+{
+	os << "\t\t\"" << name << "\": [";
+	for (size_t i = 0; i < stage.size(); ++i) {
+		const StageCounters& counters = stage[i];
+		os << (i == 0 ? "\n" : ",\n") << "\t\t\t{";
+		for (size_t c = 0; c < COUNTER_BUSY_NANOSECONDS; ++c) {
+			os << '"' << COUNTER_NAMES[c] << "\": " << counters.get(Counter(c)) << ", ";
+		}
+		double busy = counters.get(COUNTER_BUSY_NANOSECONDS) * 1e-9;
+		os << "\"busy_seconds\": " << busy
+		   << ", \"busy_fraction\": " << (seconds > 0 ? busy / seconds : 0)
+		   << ", \"reads_per_second\": "
+		   << (seconds > 0 ? counters.get(COUNTER_READS) / seconds : 0)
+		   << ", \"bases_per_second\": "
+		   << (seconds > 0 ? counters.get(COUNTER_BASES) / seconds : 0) << '}';
+	}
+	os << "\n\t\t]";
+}
+
+inline void
+PipelineStats::write(std::ostream& os, const std::string& pass) const
+{
+	double seconds = elapsed();
+	std::ostringstream ss;
+	ss << std::fixed << std::setprecision(3) << "{\n\t\"pass\": \"" << pass
+	   << "\",\n\t\"elapsed_seconds\": " << seconds << ",\n\t\"buffers\": {";
+	for (size_t i = 0; i < buffers.size(); ++i) {
+		const BufferSamples& samples = buffers[i];
+		ss << (i == 0 ? "\n" : ",\n") << "\t\t\"" << samples.name
+		   << "\": {\"capacity\": " << samples.capacity << ", \"mean_occupancy\": "
+		   << (samples.samples > 0 ? double(samples.sum) / samples.samples : 0)
+		   << ", \"max_occupancy\": " << samples.max
+		   << ", \"full_waits\": " << samples.full->waits.load(std::memory_order_relaxed)
+		   << ", \"full_wait_seconds\": "
+		   << samples.full->nanoseconds.load(std::memory_order_relaxed) * 1e-9
+		   << ", \"empty_waits\": " << samples.empty->waits.load(std::memory_order_relaxed)
+		   << ", \"empty_wait_seconds\": "
+		   << samples.empty->nanoseconds.load(std::memory_order_relaxed) * 1e-9 << '}';
+	}
+	ss << "\n\t},\n\t\"threads\": {\n";
+	writeStage(ss, "input", input, seconds);
+	ss << ",\n";
+	writeStage(ss, "minimize", minimize, seconds);
+	ss << ",\n";
+	writeStage(ss, "output", output, seconds);
+	ss << "\n\t}\n}\n";
+	os << ss.str();
+}
+
+#endif
@@ -2,35 +2,30 @@
 #define INDEXLR_WORKERS_H
 
 #include "btl_bloomfilter/BloomFilter.hpp"
+#include "indexlr-aggregate.h"
 #include "indexlr-buffer.h"
+#include "indexlr-fastx.h"
+#include "indexlr-inflate.h"
 #include "indexlr-minimize.h"
+#include "indexlr-sketch.h"
+#include "indexlr-stats.h"
+#include "physlr-mxstream.h"
 
-#include "kseq.h" // NOLINT
-#include <zlib.h>
-KSEQ_INIT(gzFile, gzread) // NOLINT
-
+#include <algorithm>
 #include <atomic>
 #include <cassert>
+#include <chrono>
 #include <cstdio>
 #include <cstring>
 #include <fstream>
 #include <limits>
+#include <memory>
 #include <sstream>
 #include <string>
 #include <thread>
 #include <utility>
 #include <vector>
 
-// A read from input file with a number associated with it
-// where first read is 0, second 1, etc...
-struct Read
-{
-	size_t num = 0;
-	std::string id;
-	std::string barcode;
-	std::string sequence;
-};
-
 // Result stores barcodes and minimizers of a block of reads
 // so that it can be written to output file in one go
 struct Result
@@ -38,39 +33,130 @@ struct Result
 	size_t num = 0;
 	std::string barcodesAndMinimizers;
 	size_t lastNum = 0;
+	// For binary output, the barcode and sorted unique minimizers of each read, concatenated
+	std::string barcodes;
+	std::vector<size_t> barcodeEnds;
+	std::vector<uint64_t> minimizers;
+	std::vector<size_t> minimizerEnds;
+
+	// The output file of the result, one per pair of k and w
+	size_t output = 0;
 
 	Result() { barcodesAndMinimizers.reserve(BLOCK_SIZE * 1024); }
 };
 
+// A k-mer size and window size to minimize the reads with
+struct MinimizerParams
+{
+	size_t k;
+	size_t w;
+};
+
+// The minimizers of the pieces of a long sequence, which different workers minimize.
+// The worker that minimizes the last remaining piece writes the minimizers of the sequence.
+struct SequencePieces
+{
+	SequencePieces(size_t length, size_t count)
+	  : length(length)
+	  , minimizers(count)
+	  , remaining(count)
+	{}
+
+	const size_t length;
+	std::vector<std::vector<HashData>> minimizers;
+	// The number of k-mers hashed in the pieces
+	std::atomic<size_t> nhashes{ 0 };
+	std::atomic<size_t> remaining;
+};
+
 class InputWorker;
 class MinimizeWorker;
 class OutputWorker;
 
+// Read several input files concurrently into one buffer of blocks of reads.
+// Each thread reads one file at a time, taking the next file once it finishes.
+// With fileOrder, the blocks of each file follow all the blocks of the previous file,
+// and a thread reads ahead up to LOOKAHEAD_BLOCKS blocks while it waits for its turn.
+// Otherwise the blocks of different files interleave, in order within each file, but in an order
+// across files that varies from run to run.
+// A sequence of more than pieceLength k-mers is split into pieces of pieceLength k-mers, one per
+// block, so that all the minimize workers share it.
 class InputWorker
 {
 
   public:
-	explicit InputWorker(std::string ipath)
-	  : ipath(std::move(ipath))
-	{}
+	InputWorker(
+	    std::vector<std::string> ipaths,
+	    unsigned threads,
+	    unsigned inflateThreads,
+	    bool fileOrder,
+	    size_t k,
+	    size_t w,
+	    size_t pieceLength,
+	    std::vector<StageCounters>& counters)
+	  : ipaths(std::move(ipaths))
+	  , threads(std::max(1U, std::min<unsigned>(threads, this->ipaths.size())))
+	  , inflateThreads(inflateThreads)
+	  , fileOrder(fileOrder)
+	  , k(k)
+	  , w(w)
+	  , pieceLength(pieceLength)
+	  , counters(counters)
+	{
+		assert(counters.size() >= this->threads);
+	}
 
-	void start() { t = std::thread(doWork, this); }
+	void start()
+	{
+		active = threads;
+		for (unsigned i = 0; i < threads; ++i) {
+			ts.emplace_back(doWork, this, i);
+		}
+	}
 
-	void join() { t.join(); }
+	void join()
+	{
+		for (auto& t : ts) {
+			t.join();
+		}
+	}
 
-	std::atomic<bool> allRead{ false };
-	size_t inputNum = 0;
-	std::atomic<bool> fasta{ false };
-	InputBuffer<Block<Read>> buffer;
+	InputBuffer<ReadBlock> buffer;
 
   private:
-	const std::string ipath;
-
-	inline void work();
-
-	static void doWork(InputWorker* worker) { worker->work(); }
-
-	std::thread t;
+	// Number of blocks a thread reads ahead while it waits for its turn in file order
+	static const size_t LOOKAHEAD_BLOCKS = 256;
+
+	const std::vector<std::string> ipaths;
+	const unsigned threads;
+	const unsigned inflateThreads;
+	const bool fileOrder;
+	const size_t k;
+	const size_t w;
+	const size_t pieceLength;
+	// The counters of each thread
+	std::vector<StageCounters>& counters;
+	// The next file to read
+	std::atomic<size_t> nextFile{ 0 };
+	// In file order, the file whose blocks are written to the buffer now
+	std::atomic<size_t> turn{ 0 };
+	// The number of threads still reading
+	std::atomic<unsigned> active{ 0 };
+
+	inline void work(unsigned thread);
+	inline void readFile(size_t file, StageCounters& counters);
+
+	template<typename Write>
+	inline void writeBlock(ReadBlock& block, Write write);
+
+	template<typename Write>
+	inline void writePieces(const Read& read, Write write);
+
+	static inline void appendRead(ReadBlock& block, const Read& read, StringView sequence);
+
+	static void doWork(InputWorker* worker, unsigned thread) { worker->work(thread); }
+
+	std::vector<std::thread> ts;
 };
 
 class MinimizeWorker
@@ -78,56 +164,57 @@ class MinimizeWorker
 
   public:
 	MinimizeWorker(
-	    size_t k,
-	    size_t w,
+	    std::vector<MinimizerParams> params,
 	    bool withRepeat,
 	    bool withSolid,
 	    bool withPositions,
 	    bool withStrands,
+	    bool binary,
 	    bool verbose,
+	    RollNtHash roll,
 	    const BloomFilter& repeatBF,
 	    const BloomFilter& solidBF,
 	    InputWorker& inputWorker,
-	    OutputWorker& outputWorker)
-	  : k(k)
-	  , w(w)
-	  , withRepeat(withRepeat)
-	  , withSolid(withSolid)
-	  , withPositions(withPositions)
-	  , withStrands(withStrands)
+	    OutputWorker* outputWorker,
+	    BarcodeAggregator* aggregator,
+	    MinimizerSketch* sketch,
+	    bool unordered,
+	    StageCounters& counters)
+	  : params(std::move(params))
+	  , binary(binary)
+	  , unordered(unordered)
 	  , verbose(verbose)
+	  , roll(roll)
 	  , repeatBF(repeatBF)
 	  , solidBF(solidBF)
 	  , inputWorker(inputWorker)
 	  , outputWorker(outputWorker)
+	  , aggregator(aggregator)
+	  , sketch(sketch)
+	  , counting(sketch != nullptr && sketch->isCounting())
+	  , counters(&counters)
+	  , work(selectWork(withRepeat, withSolid, withPositions, withStrands))
 	{}
 
 	MinimizeWorker(const MinimizeWorker& worker)
-	  : k(worker.k)
-	  , w(worker.w)
-	  , withRepeat(worker.withRepeat)
-	  , withSolid(worker.withSolid)
-	  , withPositions(worker.withPositions)
-	  , withStrands(worker.withStrands)
+	  : params(worker.params)
+	  , binary(worker.binary)
+	  , unordered(worker.unordered)
 	  , verbose(worker.verbose)
+	  , roll(worker.roll)
 	  , repeatBF(worker.repeatBF)
 	  , solidBF(worker.solidBF)
 	  , inputWorker(worker.inputWorker)
 	  , outputWorker(worker.outputWorker)
+	  , aggregator(worker.aggregator)
+	  , sketch(worker.sketch)
+	  , counting(worker.counting)
+	  , counters(worker.counters)
+	  , work(worker.work)
 	{}
 
 	MinimizeWorker(MinimizeWorker&& worker) noexcept
-	  : k(worker.k)
-	  , w(worker.w)
-	  , withRepeat(worker.withRepeat)
-	  , withSolid(worker.withRepeat)
-	  , withPositions(worker.withPositions)
-	  , withStrands(worker.withStrands)
-	  , verbose(worker.verbose)
-	  , repeatBF(worker.repeatBF)
-	  , solidBF(worker.solidBF)
-	  , inputWorker(worker.inputWorker)
-	  , outputWorker(worker.outputWorker)
+	  : MinimizeWorker(static_cast<const MinimizeWorker&>(worker))
 	{}
 
 	MinimizeWorker& operator=(const MinimizeWorker& worker) = delete;
@@ -140,46 +227,151 @@ class MinimizeWorker
 	void join() { t.join(); }
 
   private:
-	size_t k = 0;
-	size_t w = 0;
-	bool withRepeat = false;
-	bool withSolid = false;
-	bool withPositions = false;
-	bool withStrands = false;
+	// The work of a worker with its options fixed at compile time
+	using Work = void (MinimizeWorker::*)();
+
+	// The pairs of k and w, each written to its own output
+	std::vector<MinimizerParams> params;
+	bool binary = false;
+	// Write the blocks of reads in the order they are minimized rather than in input order
+	bool unordered = false;
 	bool verbose = false;
+	RollNtHash roll = nullptr;
 	const BloomFilter& repeatBF;
 	const BloomFilter& solidBF;
 	InputWorker& inputWorker;
-	OutputWorker& outputWorker;
+	// Either the output of the minimizers of each read, or the aggregator of each barcode
+	OutputWorker* outputWorker;
+	BarcodeAggregator* aggregator;
+	// With --auto-filter, the sketch that counts the minimizers in the first pass, and filters
+	// them in the second
+	MinimizerSketch* sketch;
+	bool counting;
+	// The counts of the block being minimized, and the counters they are added to
+	StageCounts counts;
+	StageCounters* counters;
+	Work work;
+
+	template<bool withRepeat, bool withSolid, bool withPositions, bool withStrands>
+	inline void minimize();
+
+	// The hashes of the k-mers of a read, and whether each is in the Bloom filters
+	struct Scratch
+	{
+		std::vector<HashData> hashes;
+		std::vector<uint64_t> keys;
+		std::vector<unsigned char> repeats;
+		std::vector<unsigned char> solids;
+	};
+
+	// The minimizers of a block of reads for one pair of k and w
+	struct Output
+	{
+		Output(MinimizerParams params, size_t index)
+		  : params(params)
+		  , index(index)
+		  , window(params.w)
+		{}
+
+		const MinimizerParams params;
+		// The index of the output among the outputs of the block
+		const size_t index;
+		WindowMinimizer window;
+		std::stringstream ss;
+		Result result;
+		// The separator before the next minimizer of the read, and the first minimizer of the
+		// read in the result
+		char sep = '\t';
+		size_t mxStart = 0;
+		// The number of minimizers reported since it was last counted
+		size_t minimizers = 0;
+	};
+
+	// Report the minimizers of a window to an output
+	template<bool withPositions, bool withStrands>
+	struct Emitter
+	{
+		const MinimizeWorker* worker;
+		Output* out;
 
-	inline void work();
+		void operator()(const HashData& m) const
+		{
+			worker->emit<withPositions, withStrands>(*out, m);
+		}
+	};
+
+	template<bool withRepeat, bool withSolid>
+	inline size_t hashSequence(StringView sequence, KmerHasher& hasher, Scratch& scratch);
 
-	static void doWork(MinimizeWorker* worker) { worker->work(); }
+	template<bool withRepeat, bool withSolid, typename Emit>
+	inline size_t minimizeSequence(
+	    StringView sequence,
+	    KmerHasher& hasher,
+	    WindowMinimizer& window,
+	    Scratch& scratch,
+	    Emit& emit);
+
+	template<bool withRepeat, bool withSolid>
+	inline bool minimizePiece(
+	    const ReadBlock& reads,
+	    KmerHasher& hasher,
+	    WindowMinimizer& window,
+	    Scratch& scratch);
+
+	inline void startRead(Output& out, const Read& read) const;
+
+	template<bool withPositions, bool withStrands>
+	inline void emit(Output& out, const HashData& m) const;
+
+	inline void finishRead(Output& out, const Read& read, size_t length, size_t nhashes) const;
+
+	inline void finishBlock(Output& out, const ReadBlock& reads) const;
+
+	inline void
+	warn(const Read& read, const MinimizerParams& params, size_t length, size_t nhashes) const;
+
+	static inline Work
+	selectWork(bool withRepeat, bool withSolid, bool withPositions, bool withStrands);
+
+	static void doWork(MinimizeWorker* worker) { (worker->*(worker->work))(); }
 
 	std::thread t;
 };
 
+// Write the results of the minimize workers to one or more output files, one per pair of k and w.
+// The results of a block of reads are consecutive in the buffer, one per output.
 class OutputWorker
 {
 
   public:
-	OutputWorker(std::string opath, const InputWorker& inputWorker)
-	  : opath(std::move(opath))
-	  , inputWorker(inputWorker)
+	OutputWorker(std::vector<std::string> opaths, bool binary, StageCounters& counters)
+	  : opaths(std::move(opaths))
+	  , binary(binary)
+	  , counters(counters)
+	{}
+
+	// Open the output files and start writing to them.
+	void start()
 	{
-		ofs.open(this->opath);
+		for (const auto& opath : opaths) {
+			files.emplace_back(new std::ofstream(opath));
+			if (binary) {
+				writers.emplace_back(new MxWriter(*files.back(), opath));
+			}
+		}
+		t = std::thread(doWork, this);
 	}
 
-	void start() { t = std::thread(doWork, this); }
-
 	void join() { t.join(); }
 
 	OutputBuffer<Result> buffer;
 
   private:
-	const std::string opath;
-	std::ofstream ofs;
-	const InputWorker& inputWorker;
+	const std::vector<std::string> opaths;
+	const bool binary;
+	std::vector<std::unique_ptr<std::ofstream>> files;
+	std::vector<std::unique_ptr<MxWriter>> writers;
+	StageCounters& counters;
 
 	inline void work();
 
@@ -189,191 +381,549 @@ class OutputWorker
 };
 
 inline void
-InputWorker::work()
+InputWorker::work(unsigned thread)
 {
-	gzFile fp = gzopen(ipath.c_str(), "r");
-
-	char c;
-	c = gzgetc(fp);
-	gzungetc(c, fp);
-	if (c == '>') {
-		fasta = true;
-	} else {
-		fasta = false;
+	for (size_t file; (file = nextFile.fetch_add(1)) < ipaths.size();) {
+		readFile(file, counters[thread]);
+	}
+	if (active.fetch_sub(1) == 1) {
+		buffer.close();
 	}
+}
 
-	if (gzeof(fp)) {
+inline void
+InputWorker::readFile(size_t file, StageCounters& counters)
+{
+	const std::string& ipath = ipaths[file];
+	InflateStream stream(ipath, inflateThreads);
+	if (stream.peek() == EOF) {
 		std::cerr << "physlr-indexlr: error: Empty input file: " << ipath << '\n';
 		exit(EXIT_FAILURE);
-	} else {
-		kseq_t* seq = kseq_init(fp);
-
-		bool done = false;
-		while (true) {
-			size_t currentNum = inputNum;
-			Block<Read>& reads = buffer.getWriteAccess(currentNum);
-
-			reads.dataCounter = 0;
-			for (auto& read : reads.data) {
-				if (kseq_read(seq) < 0) {
-					done = true;
-					break;
-				}
-
-				read.id = seq->name.l > 0 ? seq->name.s : "";
-				read.barcode = seq->comment.l > 0 ? seq->comment.s : "";
-				read.sequence = seq->seq.l > 0 ? seq->seq.s : "";
+	}
 
-				read.num = inputNum;
-				++inputNum;
-				++reads.dataCounter;
+	FastxParser parser(stream);
+	size_t inputNum = 0;
+	StageCounts counts;
+	// Parse a block of reads, which includes decompressing them.
+	auto parse = [&](ReadBlock& block) {
+		auto start = std::chrono::steady_clock::now();
+		size_t n = parser.readBlock(block, inputNum);
+		counts.addBusy(start);
+		inputNum += n;
+		if (n > 0) {
+			++counts[COUNTER_BLOCKS];
+			counts[COUNTER_READS] += n;
+			for (size_t i = 0; i < n; ++i) {
+				counts[COUNTER_BASES] += block.data[i].sequence.size;
 			}
-			if (reads.dataCounter > 0) {
-				reads.num = reads.data[0].num;
-			} else {
-				reads.num = inputNum - 1;
+		}
+		counters.add(counts);
+		return n;
+	};
+	ReadBlock reads;
+	auto publish = [&](ReadBlock& block) {
+		block.seq = buffer.claim();
+		buffer.write(block, block.seq);
+	};
+	auto write = [&](ReadBlock& block) { writeBlock(block, publish); };
+	if (fileOrder) {
+		// Read ahead until it is the turn of this file.
+		std::vector<ReadBlock> lookahead;
+		Backoff backoff;
+		while (turn.load(std::memory_order_acquire) != file) {
+			if (lookahead.size() == LOOKAHEAD_BLOCKS) {
+				backoff.wait();
+				continue;
 			}
-
-			if (done) {
-				allRead = true;
-				buffer.releaseWriteAccess(currentNum);
-				if (buffer.elements() == 0) {
-					buffer.close();
-				}
+			lookahead.emplace_back();
+			if (parse(lookahead.back()) == 0) {
+				lookahead.pop_back();
 				break;
 			}
-			buffer.releaseWriteAccess(currentNum);
 		}
+		while (turn.load(std::memory_order_acquire) != file) {
+			backoff.wait();
+		}
+		for (auto& block : lookahead) {
+			write(block);
+		}
+	}
+	while (parse(reads) > 0) {
+		write(reads);
+	}
+	if (fileOrder) {
+		turn.store(file + 1, std::memory_order_release);
+	}
+}
 
-		kseq_destroy(seq);
+// Write a block of reads, and split each sequence of more than pieceLength k-mers into pieces.
+// The reads around a long sequence keep their order in blocks of their own.
+template<typename Write>
+inline void
+InputWorker::writeBlock(ReadBlock& block, Write write)
+{
+	auto isLong = [&](const Read& read) {
+		return pieceLength > 0 && read.sequence.size >= pieceLength + k;
+	};
+	if (std::none_of(block.data, block.data + block.dataCounter, isLong)) {
+		write(block);
+		return;
+	}
+	ReadBlock part;
+	auto clear = [&]() {
+		part.arena.clear();
+		part.arena.reserve(block.arena.size());
+		part.dataCounter = 0;
+		part.pieces.reset();
+	};
+	clear();
+	for (size_t i = 0; i < block.dataCounter; ++i) {
+		const Read& read = block.data[i];
+		if (!isLong(read)) {
+			if (part.dataCounter == 0) {
+				part.num = read.num;
+			}
+			appendRead(part, read, read.sequence);
+			continue;
+		}
+		if (part.dataCounter > 0) {
+			write(part);
+			clear();
+		}
+		writePieces(read, write);
+	}
+	if (part.dataCounter > 0) {
+		write(part);
+	}
+}
+
+// Split a long sequence into pieces of pieceLength k-mers, each the read of a block.
+// A piece also starts with the w k-mers before its own, so that its windows include the last
+// window of the previous piece, and no window is lost or reported twice at the boundary.
+template<typename Write>
+inline void
+InputWorker::writePieces(const Read& read, Write write)
+{
+	const StringView& seq = read.sequence;
+	const size_t nkmers = seq.size - k + 1;
+	const size_t count = (nkmers + pieceLength - 1) / pieceLength;
+	auto pieces = std::make_shared<SequencePieces>(seq.size, count);
+	ReadBlock block;
+	for (size_t j = 0; j < count; ++j) {
+		const size_t begin = j * pieceLength;
+		const size_t end = std::min(begin + pieceLength, nkmers);
+		// Find the w k-mers without non-ACGT characters before begin, scanning backward with
+		// the number of ACGT characters that follow each position.
+		size_t start = begin;
+		size_t overlapKmers = 0;
+		size_t run = 0;
+		for (size_t p = begin + k - 1; p-- > 0 && overlapKmers < w;) {
+			run = seedTab[static_cast<unsigned char>(seq[p])] == seedN ? 0 : run + 1;
+			if (p < begin && run >= k) {
+				start = p;
+				++overlapKmers;
+			}
+		}
+		const size_t length = end + k - 1 - start;
+		block.arena.clear();
+		block.arena.reserve(read.id.size + read.barcode.size + length);
+		block.dataCounter = 0;
+		appendRead(block, read, StringView(seq.data + start, length));
+		block.num = read.num;
+		block.pieces = pieces;
+		block.piece = j;
+		block.offset = start;
+		block.overlapKmers = overlapKmers;
+		write(block);
 	}
+}
+
+// Append a read with the given sequence to a block whose arena has the capacity for it, so
+// that the views of its other reads stay valid.
+inline void
+InputWorker::appendRead(ReadBlock& block, const Read& read, StringView sequence)
+{
+	std::vector<char>& arena = block.arena;
+	assert(arena.capacity() - arena.size() >= read.id.size + read.barcode.size + sequence.size);
+	auto append = [&arena](StringView s) {
+		const char* data = arena.data() + arena.size();
+		arena.insert(arena.end(), s.data, s.data + s.size);
+		return StringView(data, s.size);
+	};
+	Read& copy = block.data[block.dataCounter++];
+	copy.num = read.num;
+	copy.id = append(read.id);
+	copy.barcode = append(read.barcode);
+	copy.sequence = append(sequence);
+}
 
-	gzclose(fp);
+// Return the instantiation of minimize for the options, so that its loops do not test them.
+inline MinimizeWorker::Work
+MinimizeWorker::selectWork(bool withRepeat, bool withSolid, bool withPositions, bool withStrands)
+{
+	static const Work works[] = {
+		&MinimizeWorker::minimize<false, false, false, false>,
+		&MinimizeWorker::minimize<false, false, false, true>,
+		&MinimizeWorker::minimize<false, false, true, false>,
+		&MinimizeWorker::minimize<false, false, true, true>,
+		&MinimizeWorker::minimize<false, true, false, false>,
+		&MinimizeWorker::minimize<false, true, false, true>,
+		&MinimizeWorker::minimize<false, true, true, false>,
+		&MinimizeWorker::minimize<false, true, true, true>,
+		&MinimizeWorker::minimize<true, false, false, false>,
+		&MinimizeWorker::minimize<true, false, false, true>,
+		&MinimizeWorker::minimize<true, false, true, false>,
+		&MinimizeWorker::minimize<true, false, true, true>,
+		&MinimizeWorker::minimize<true, true, false, false>,
+		&MinimizeWorker::minimize<true, true, false, true>,
+		&MinimizeWorker::minimize<true, true, true, false>,
+		&MinimizeWorker::minimize<true, true, true, true>,
+	};
+	size_t i = (withRepeat ? 8 : 0) + (withSolid ? 4 : 0) + (withPositions ? 2 : 0) +
+	           (withStrands ? 1 : 0);
+	return works[i];
 }
 
+// Warn of a read too short to have a minimizer.
 inline void
-MinimizeWorker::work()
+MinimizeWorker::warn(
+    const Read& read,
+    const MinimizerParams& params,
+    size_t length,
+    size_t nhashes) const
 {
-	Block<Read> reads;
 	std::stringstream ss;
-	Result result;
-	while (!inputWorker.allRead || inputWorker.buffer.elements() != 0) {
-		inputWorker.buffer.read(reads);
-		if (inputWorker.buffer.isClosed()) {
-			break;
+	if (length < params.k) {
+		ss << "physlr-indexlr: warning: Skip read " << (read.num + 1) << " on line "
+		   << (read.num + 1) * 4 - 2 << "; k > read length "
+		   << "(k = " << params.k << ", read length = " << length << ")\n";
+	}
+	if (params.w > nhashes) {
+		ss << "physlr-indexlr: warning: Skip read " << (read.num + 1) << " on line "
+		   << (read.num + 1) * 4 - 2 << "; window size > #hashes (w = " << params.w
+		   << ", #hashes = " << nhashes << ")\n";
+	}
+	std::cerr << ss.str();
+}
+
+// Hash the k-mers of a sequence into the scratch space, and mask those in the repeat filter and
+// not in the solid filter. Return the number of k-mers hashed.
+template<bool withRepeat, bool withSolid>
+inline size_t
+MinimizeWorker::hashSequence(StringView sequence, KmerHasher& hasher, Scratch& scratch)
+{
+	// Query the Bloom filters for the whole read at once, to overlap cache misses.
+	scratch.hashes.clear();
+	scratch.keys.clear();
+	size_t nhashes =
+	    hasher.forEach(sequence.data, sequence.size, [&](const HashData& hash) {
+		    scratch.hashes.push_back(hash);
+		    if (withRepeat || withSolid) {
+			    scratch.keys.push_back(hash.hash1);
+		    }
+	    });
+	if (withRepeat) {
+		scratch.repeats.resize(nhashes);
+		repeatBF.contains(scratch.keys.data(), nhashes, scratch.repeats.data());
+		counts[COUNTER_REPEAT_QUERIES] += nhashes;
+	}
+	if (withSolid) {
+		scratch.solids.resize(nhashes);
+		solidBF.contains(scratch.keys.data(), nhashes, scratch.solids.data());
+		counts[COUNTER_SOLID_QUERIES] += nhashes;
+	}
+	if (withRepeat || withSolid) {
+		for (size_t j = 0; j < nhashes; ++j) {
+			if ((withRepeat && scratch.repeats[j] != 0) ||
+			    (withSolid && scratch.solids[j] == 0)) {
+				scratch.hashes[j].hash1 = UINT64_MAX;
+			}
+		}
+	}
+	return nhashes;
+}
+
+// Hash the k-mers of a sequence, mask those in the repeat filter and not in the solid filter,
+// and call emit(minimizer) for each minimizer. Return the number of k-mers hashed.
+template<bool withRepeat, bool withSolid, typename Emit>
+inline size_t
+MinimizeWorker::minimizeSequence(
+    StringView sequence,
+    KmerHasher& hasher,
+    WindowMinimizer& window,
+    Scratch& scratch,
+    Emit& emit)
+{
+	window.reset();
+	if (!withRepeat && !withSolid) {
+		return hasher.forEach(sequence.data, sequence.size, [&](const HashData& hash) {
+			window.push(hash, emit);
+		});
+	}
+	size_t nhashes = hashSequence<withRepeat, withSolid>(sequence, hasher, scratch);
+	for (const auto& hash : scratch.hashes) {
+		window.push(hash, emit);
+	}
+	return nhashes;
+}
+
+// Minimize the piece of a long sequence that is the read of a block, with the positions of its
+// minimizers in the sequence. Return true if it is the last of the pieces to be minimized.
+template<bool withRepeat, bool withSolid>
+inline bool
+MinimizeWorker::minimizePiece(
+    const ReadBlock& reads,
+    KmerHasher& hasher,
+    WindowMinimizer& window,
+    Scratch& scratch)
+{
+	SequencePieces& pieces = *reads.pieces;
+	std::vector<HashData>& minimizers = pieces.minimizers[reads.piece];
+	minimizers.clear();
+	// The first window of a piece that starts with w k-mers of the previous piece is the last
+	// window of the previous piece, which reported its minimizer.
+	bool skip = reads.overlapKmers >= params[0].w;
+	auto collect = [&](const HashData& m) {
+		if (skip) {
+			skip = false;
+			return;
+		}
+		if (m.hash1 != UINT64_MAX) {
+			minimizers.push_back(m);
+			minimizers.back().pos += reads.offset;
+		}
+	};
+	size_t nhashes = minimizeSequence<withRepeat, withSolid>(
+	    reads.data[0].sequence, hasher, window, scratch, collect);
+	pieces.nhashes.fetch_add(nhashes - reads.overlapKmers, std::memory_order_relaxed);
+	return pieces.remaining.fetch_sub(1, std::memory_order_acq_rel) == 1;
+}
+
+// Start the minimizers of a read.
+inline void
+MinimizeWorker::startRead(Output& out, const Read& read) const
+{
+	out.mxStart = out.result.minimizers.size();
+	out.sep = '\t';
+	// Binary and aggregated output are the sorted unique minimizers of each read.
+	if (!binary && aggregator == nullptr) {
+		out.ss << read.barcode;
+	}
+}
+
+// Report a minimizer of a read, unless it is masked or filtered out.
+template<bool withPositions, bool withStrands>
+inline void
+MinimizeWorker::emit(Output& out, const HashData& m) const
+{
+	if (m.hash1 == UINT64_MAX) {
+		return;
+	}
+	if (sketch != nullptr) {
+		if (counting) {
+			sketch->add(m);
+			return;
 		}
-		if (inputWorker.allRead && inputWorker.buffer.elements() == 0) {
-			inputWorker.buffer.close();
+		if (!sketch->keep(m)) {
+			return;
 		}
+	}
+	++out.minimizers;
+	if (binary || aggregator != nullptr) {
+		out.result.minimizers.push_back(m.hash2);
+		return;
+	}
+	out.ss << out.sep << m.hash2;
+	if (withPositions) {
+		out.ss << ':' << m.pos;
+	}
+	if (withStrands) {
+		out.ss << ':' << m.strand;
+	}
+	out.sep = ' ';
+}
 
-		ss.str("");
+// Finish the minimizers of a read of length bases and nhashes k-mers.
+inline void
+MinimizeWorker::finishRead(Output& out, const Read& read, size_t length, size_t nhashes) const
+{
+	Result& result = out.result;
+	if (binary || aggregator != nullptr) {
+		auto begin = result.minimizers.begin() + out.mxStart;
+		std::sort(begin, result.minimizers.end());
+		result.minimizers.erase(
+		    std::unique(begin, result.minimizers.end()), result.minimizers.end());
+		if (aggregator != nullptr) {
+			aggregator->add(
+			    read.barcode,
+			    result.minimizers.data() + out.mxStart,
+			    result.minimizers.size() - out.mxStart);
+			result.minimizers.resize(out.mxStart);
+		} else {
+			result.minimizerEnds.push_back(result.minimizers.size());
+			result.barcodes.append(read.barcode.data, read.barcode.size);
+			result.barcodeEnds.push_back(result.barcodes.size());
+		}
+	} else {
+		if (nhashes < out.params.w) {
+			// No minimizer, not even a masked one
+			out.ss << out.sep;
+		}
+		out.ss << '\n';
+	}
+
+	if (verbose && (length < out.params.k || out.params.w > nhashes)) {
+		warn(read, out.params, length, nhashes);
+	}
+}
+
+// Write the minimizers of a block of reads to the output.
+inline void
+MinimizeWorker::finishBlock(Output& out, const ReadBlock& reads) const
+{
+	Result& result = out.result;
+	result.output = out.index;
+	result.num = reads.num;
+	if (reads.dataCounter > 0) {
+		assert(reads.dataCounter - 1 < sizeof(reads.data) / sizeof(reads.data[0]));
+		result.lastNum = reads.data[reads.dataCounter - 1].num;
+		result.barcodesAndMinimizers = out.ss.str();
+	} else {
+		result.lastNum = reads.num;
+		result.barcodesAndMinimizers = "";
+	}
+	if (outputWorker != nullptr) {
+		// The results of a block are consecutive, one per output.
+		size_t pos = unordered ? outputWorker->buffer.claim()
+		                       : reads.seq * params.size() + out.index;
+		outputWorker->buffer.write(result, pos);
+	}
+	out.ss.str("");
+	result.barcodes.clear();
+	result.barcodeEnds.clear();
+	result.minimizers.clear();
+	result.minimizerEnds.clear();
+}
+
+template<bool withRepeat, bool withSolid, bool withPositions, bool withStrands>
+inline void
+MinimizeWorker::minimize()
+{
+	// One hasher per distinct k, each with the outputs of the pairs of k and w with that k, so
+	// that the k-mers of a read are hashed once for all the window sizes.
+	std::vector<KmerHasher> hashers;
+	std::vector<std::vector<size_t>> groups;
+	std::vector<Output> outputs;
+	outputs.reserve(params.size());
+	for (size_t i = 0; i < params.size(); ++i) {
+		outputs.emplace_back(params[i], i);
+		size_t g = 0;
+		while (g < hashers.size() && params[groups[g][0]].k != params[i].k) {
+			++g;
+		}
+		if (g == hashers.size()) {
+			hashers.emplace_back(params[i].k, roll);
+			groups.emplace_back();
+		}
+		groups[g].push_back(i);
+	}
+	std::vector<std::vector<Emitter<withPositions, withStrands>>> emitters(groups.size());
+	for (size_t g = 0; g < groups.size(); ++g) {
+		for (size_t o : groups[g]) {
+			emitters[g].push_back(Emitter<withPositions, withStrands>{ this, &outputs[o] });
+		}
+	}
+
+	ReadBlock reads;
+	Scratch scratch;
+	while (inputWorker.buffer.read(reads)) {
+		auto start = std::chrono::steady_clock::now();
+		size_t kmers = 0;
 		for (size_t i = 0; i < reads.dataCounter; i++) {
 			assert(i < sizeof(reads.data) / sizeof(reads.data[0]));
 			Read& read = reads.data[i];
 
-			if (startsWith(read.barcode, "BX:Z:")) {
-				auto pos = read.barcode.find(' ');
-				if (pos != std::string::npos) {
-					read.barcode.erase(pos);
+			if (reads.pieces) {
+				// The worker that minimizes the last piece writes the whole sequence.
+				// A sequence is split in pieces only for a single pair of k and w.
+				Output& out = outputs[0];
+				bool last =
+				    minimizePiece<withRepeat, withSolid>(reads, hashers[0], out.window, scratch);
+				if (!last) {
+					continue;
 				}
-				read.barcode.erase(0, 5);
-			} else if (inputWorker.fasta) {
-				// For FASTA, use the sequence ID.
-				read.barcode = read.id;
-			} else {
-				// No barcode tag is present. Check for stLFR barcode within read.id.
-				read.barcode = "NA";
-				size_t sharpPos = read.id.find('#');
-				if (sharpPos != std::string::npos) {
-					size_t slashPos = read.id.rfind('/');
-					if (slashPos > sharpPos) {
-						read.barcode = read.id.substr(sharpPos + 1, slashPos - 1 - sharpPos);
+				startRead(out, read);
+				for (const auto& minimizers : reads.pieces->minimizers) {
+					for (const auto& m : minimizers) {
+						emit<withPositions, withStrands>(out, m);
 					}
 				}
+				size_t nhashes = reads.pieces->nhashes.load(std::memory_order_relaxed);
+				finishRead(out, read, reads.pieces->length, nhashes);
+				++counts[COUNTER_READS];
+				counts[COUNTER_BASES] += reads.pieces->length;
+				kmers += nhashes;
+				continue;
 			}
 
-			if (read.sequence.size() < k) {
-				if (verbose) {
-					std::stringstream ss;
-					ss << "physlr-indexlr: warning: Skip read " << (read.num + 1) << " on line "
-					   << (read.num + 1) * 4 - 2 << "; k > read length "
-					   << "(k = " << k << ", read length = " << read.sequence.size() << ")\n";
-					std::cerr << ss.str();
+			for (size_t g = 0; g < groups.size(); ++g) {
+				if (groups[g].size() == 1) {
+					Output& out = outputs[groups[g][0]];
+					auto emitTo = [&](const HashData& m) {
+						emit<withPositions, withStrands>(out, m);
+					};
+					startRead(out, read);
+					size_t nhashes = minimizeSequence<withRepeat, withSolid>(
+					    read.sequence, hashers[g], out.window, scratch, emitTo);
+					finishRead(out, read, read.sequence.size, nhashes);
+					kmers += nhashes;
+					continue;
 				}
-			}
-
-			auto hashes = hashKmers(read.sequence, k);
-			if (w > hashes.size()) {
-				if (verbose) {
-					std::stringstream ss;
-					ss << "physlr-indexlr: warning: Skip read " << (read.num + 1) << " on line "
-					   << (read.num + 1) * 4 - 2 << "; window size > #hashes (w = " << w
-					   << ", #hashes = " << hashes.size() << ")\n";
-					std::cerr << ss.str();
+				// Hash once, and push each hash into the window of every window size.
+				for (auto& emitter : emitters[g]) {
+					startRead(*emitter.out, read);
+					emitter.out->window.reset();
 				}
-			}
-
-			if (withRepeat && withSolid) {
-				for (auto hashesIt = hashes.begin(); hashesIt < hashes.end(); ++hashesIt) {
-					vector<uint64_t> vect{ (*hashesIt).hash1 };
-					if (repeatBF.contains(vect) || !solidBF.contains(vect)) {
-						(*hashesIt).hash1 = UINT64_MAX;
-					}
-				}
-			} else {
-				if (withRepeat) {
-					for (auto hashesIt = hashes.begin(); hashesIt < hashes.end(); ++hashesIt) {
-						vector<uint64_t> vect{ (*hashesIt).hash1 };
-						if (repeatBF.contains(vect)) {
-							(*hashesIt).hash1 = UINT64_MAX;
+				size_t nhashes = 0;
+				if (!withRepeat && !withSolid) {
+					nhashes = hashers[g].forEach(
+					    read.sequence.data, read.sequence.size, [&](const HashData& hash) {
+						    for (auto& emitter : emitters[g]) {
+							    emitter.out->window.push(hash, emitter);
+						    }
+					    });
+				} else {
+					nhashes =
+					    hashSequence<withRepeat, withSolid>(read.sequence, hashers[g], scratch);
+					for (auto& emitter : emitters[g]) {
+						for (const auto& hash : scratch.hashes) {
+							emitter.out->window.push(hash, emitter);
 						}
 					}
 				}
-
-				if (withSolid) {
-					for (auto hashesIt = hashes.begin(); hashesIt < hashes.end(); ++hashesIt) {
-						vector<uint64_t> vect{ (*hashesIt).hash1 };
-						if (!solidBF.contains(vect)) {
-							(*hashesIt).hash1 = UINT64_MAX;
-						}
-					}
+				for (auto& emitter : emitters[g]) {
+					finishRead(*emitter.out, read, read.sequence.size, nhashes);
 				}
+				kmers += nhashes;
 			}
-
-			auto minimizers = getMinimizers(hashes, w);
-
-			ss << read.barcode;
-
-			char sep = '\t';
-			if (minimizers.empty()) {
-				ss << sep;
-			}
-			for (auto& m : minimizers) {
-				if (m.hash1 != UINT64_MAX) {
-					ss << sep << m.hash2;
-					if (withPositions) {
-						ss << ':' << m.pos;
-					}
-					if (withStrands) {
-						ss << ':' << m.strand;
-					}
-					sep = ' ';
-				}
+		}
+		// The time to write the results to the output buffer is not counted as busy, since it
+		// is mostly waiting when the buffer is full.
+		counts.addBusy(start);
+		++counts[COUNTER_BLOCKS];
+		counts[COUNTER_KMERS] += kmers;
+		if (!reads.pieces) {
+			counts[COUNTER_READS] += reads.dataCounter;
+			for (size_t i = 0; i < reads.dataCounter; ++i) {
+				counts[COUNTER_BASES] += reads.data[i].sequence.size;
 			}
-			ss << '\n';
 		}
-		if (reads.dataCounter > 0) {
-			result.num = reads.num;
-			assert(reads.dataCounter - 1 < sizeof(reads.data) / sizeof(reads.data[0]));
-			result.lastNum = reads.data[reads.dataCounter - 1].num;
-			result.barcodesAndMinimizers = ss.str();
-		} else {
-			result.num = reads.num;
-			result.lastNum = reads.num;
-			result.barcodesAndMinimizers = "";
+		for (auto& out : outputs) {
+			counts[COUNTER_MINIMIZERS] += out.minimizers;
+			out.minimizers = 0;
+			finishBlock(out, reads);
 		}
-
-		outputWorker.buffer.write(result);
+		counters->add(counts);
 	}
 }
 
@@ -381,14 +931,41 @@ inline void
 OutputWorker::work()
 {
 	Result result;
-	size_t lastWritten;
-
-	do {
-		buffer.read(result);
-		ofs << result.barcodesAndMinimizers;
-		lastWritten = result.lastNum;
-		assert_good(ofs, opath);
-	} while (!inputWorker.allRead || lastWritten != inputWorker.inputNum - 1);
+	StageCounts counts;
+	while (buffer.read(result)) {
+		auto start = std::chrono::steady_clock::now();
+		++counts[COUNTER_BLOCKS];
+		if (binary) {
+			MxWriter& writer = *writers[result.output];
+			size_t bytes = writer.bytes();
+			size_t bxStart = 0, mxStart = 0;
+			for (size_t i = 0; i < result.barcodeEnds.size(); ++i) {
+				writer.write(
+				    result.barcodes.data() + bxStart,
+				    result.barcodeEnds[i] - bxStart,
+				    result.minimizers.data() + mxStart,
+				    result.minimizerEnds[i] - mxStart);
+				bxStart = result.barcodeEnds[i];
+				mxStart = result.minimizerEnds[i];
+			}
+			counts[COUNTER_READS] += result.barcodeEnds.size();
+			counts[COUNTER_BYTES] += writer.bytes() - bytes;
+		} else {
+			std::ofstream& ofs = *files[result.output];
+			ofs << result.barcodesAndMinimizers;
+			assert_good(ofs, opaths[result.output]);
+			// The block of a piece of a long sequence writes nothing unless it is the last.
+			if (!result.barcodesAndMinimizers.empty()) {
+				counts[COUNTER_READS] += result.lastNum - result.num + 1;
+			}
+			counts[COUNTER_BYTES] += result.barcodesAndMinimizers.size();
+		}
+		counts.addBusy(start);
+		counters.add(counts);
+	}
+	for (auto& writer : writers) {
+		writer->flush();
+	}
 }
 
 #endif
@@ -0,0 +1,429 @@
+#ifndef PHYSLR_BXTOMXS_H
+#define PHYSLR_BXTOMXS_H
+
+#include "physlr-mxstream.h"
+#include "tsl/robin_set.h"
+
+#include <algorithm>
+#include <cassert>
+#include <cctype>
+#include <cerrno>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <limits>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+// Minimizers being read are merged into the arrays once those not yet merged are this fraction of
+// those merged, and at least BXTOMXS_MERGE_MIN.
+const size_t BXTOMXS_MERGE_FRACTION = 4;
+const size_t BXTOMXS_MERGE_MIN = 1 << 22;
+
+// Read records of a barcode and its minimizers in TSV or the binary format, and call
+// f(bx, n, record) for each, where the barcode is the n characters at bx.
+template<typename F>
+static inline void
+readMxRecords(std::istream& is, const std::string& ipath, F f)
+{
+	std::vector<uint64_t> record;
+	if (isMxStream(is)) {
+		MxReader reader(is, ipath);
+		std::string bx;
+		while (reader.read(bx, record)) {
+			f(bx.data(), bx.size(), record);
+		}
+		return;
+	}
+	// A line is a barcode and its minimizers separated by white space.
+	std::string line;
+	while (std::getline(is, line)) {
+		const char* p = line.c_str();
+		while (*p != '\0' && std::isspace(static_cast<unsigned char>(*p)) != 0) {
+			++p;
+		}
+		const char* bxBegin = p;
+		while (*p != '\0' && std::isspace(static_cast<unsigned char>(*p)) == 0) {
+			++p;
+		}
+		const char* bxEnd = p;
+		if (bxEnd == bxBegin) {
+			continue;
+		}
+		record.clear();
+		while (true) {
+			while (*p != '\0' && std::isspace(static_cast<unsigned char>(*p)) != 0) {
+				++p;
+			}
+			if (*p == '\0') {
+				break;
+			}
+			record.push_back(strtoull(p, nullptr, 0));
+			while (*p != '\0' && std::isspace(static_cast<unsigned char>(*p)) == 0) {
+				++p;
+			}
+		}
+		f(bxBegin, bxEnd - bxBegin, record);
+	}
+}
+
+// The names of barcodes, numbered in the order they are first interned, stored one after another
+// in one array. Barcode i is names[offsets[i]] up to names[offsets[i + 1]].
+class BarcodeNames
+{
+
+  public:
+	BarcodeNames() = default;
+	BarcodeNames(const BarcodeNames&) = delete;
+	BarcodeNames& operator=(const BarcodeNames&) = delete;
+
+	// The number of barcodes
+	size_t size() const { return offsets.size() - 1; }
+
+	const char* data(size_t i) const { return names.data() + offsets[i]; }
+	size_t length(size_t i) const { return offsets[i + 1] - offsets[i]; }
+	std::string str(size_t i) const { return std::string(data(i), length(i)); }
+
+	void clear()
+	{
+		names.clear();
+		offsets.assign(1, 0);
+		finish();
+	}
+
+	// Return the number of a barcode, numbering it if it is new.
+	inline uint32_t intern(const char* bx, size_t n);
+
+	// Free the memory used to find barcodes by name, once they have all been interned.
+	void finish() { Names(0, NameHash{ this }, NameEqual{ this }).swap(ids); }
+
+	// Keep only the barcodes i for which kept[i] is true, numbered in the same order.
+	void filter(const std::vector<bool>& kept)
+	{
+		assert(ids.empty());
+		size_t nbx = 0;
+		for (size_t i = 0; i < kept.size(); ++i) {
+			if (!kept[i]) {
+				continue;
+			}
+			std::copy(
+			    names.begin() + offsets[i],
+			    names.begin() + offsets[i + 1],
+			    names.begin() + offsets[nbx]);
+			offsets[nbx + 1] = offsets[nbx] + offsets[i + 1] - offsets[i];
+			++nbx;
+		}
+		offsets.resize(nbx + 1);
+		names.resize(offsets.back());
+	}
+
+  private:
+	// FNV-1a
+	static size_t hash(const char* s, size_t n)
+	{
+		uint64_t h = 0xcbf29ce484222325;
+		for (size_t i = 0; i < n; ++i) {
+			h = (h ^ static_cast<unsigned char>(s[i])) * 0x100000001b3;
+		}
+		return h;
+	}
+
+	// Hash and compare barcodes by their number, looking up their names.
+	struct NameHash
+	{
+		const BarcodeNames* barcodes;
+
+		size_t operator()(uint32_t i) const { return hash(barcodes->data(i), barcodes->length(i)); }
+	};
+
+	struct NameEqual
+	{
+		const BarcodeNames* barcodes;
+
+		bool operator()(uint32_t i, uint32_t j) const
+		{
+			size_t n = barcodes->length(i);
+			return n == barcodes->length(j) &&
+			       std::memcmp(barcodes->data(i), barcodes->data(j), n) == 0;
+		}
+	};
+
+	using Names = tsl::robin_set<uint32_t, NameHash, NameEqual>;
+
+	std::vector<char> names;
+	std::vector<size_t> offsets{ 0 };
+	Names ids{ 0, NameHash{ this }, NameEqual{ this } };
+};
+
+inline uint32_t
+BarcodeNames::intern(const char* bx, size_t n)
+{
+	// Name the barcode with the next number, and take it back if the barcode is not new.
+	assert(size() < std::numeric_limits<uint32_t>::max());
+	auto id = static_cast<uint32_t>(size());
+	names.insert(names.end(), bx, bx + n);
+	offsets.push_back(names.size());
+	auto inserted = ids.insert(id);
+	if (!inserted.second) {
+		offsets.pop_back();
+		names.resize(offsets.back());
+	}
+	return *inserted.first;
+}
+
+// Write barcodes and their minimizers in TSV or the binary format.
+class MxsWriter
+{
+
+  public:
+	MxsWriter(std::ostream& os, std::string opath, bool binary)
+	  : os(os)
+	  , opath(std::move(opath))
+	{
+		if (binary) {
+			writer.reset(new MxWriter(os, this->opath));
+		}
+	}
+
+	MxsWriter(const MxsWriter&) = delete;
+	MxsWriter& operator=(const MxsWriter&) = delete;
+
+	// Write a barcode, the n characters at bx, and its sorted unique minimizers.
+	void write(const char* bx, size_t n, const uint64_t* mxs, size_t count)
+	{
+		if (writer) {
+			writer->write(bx, n, mxs, count);
+			return;
+		}
+		os.write(bx, n);
+		char sep = '\t';
+		for (size_t i = 0; i < count; ++i) {
+			os << sep << mxs[i];
+			sep = ' ';
+		}
+		os << '\n';
+		if (!os.good()) {
+			std::cerr << "error: " << strerror(errno) << ": " << opath << '\n';
+			exit(EXIT_FAILURE);
+		}
+	}
+
+  private:
+	std::ostream& os;
+	std::string opath;
+	std::unique_ptr<MxWriter> writer;
+};
+
+// The minimizers of each barcode in compressed sparse row form. Barcodes are numbered in the
+// order they are first read. The minimizers of barcode i are mxs[offsets[i]] up to
+// mxs[offsets[i + 1]], sorted and unique. Filters compact the arrays in place.
+class BxtoMxs
+{
+
+  public:
+	using Mx = uint64_t;
+
+	BxtoMxs() = default;
+	BxtoMxs(const BxtoMxs&) = delete;
+	BxtoMxs& operator=(const BxtoMxs&) = delete;
+
+	// The number of barcodes
+	size_t size() const { return offsets.size() - 1; }
+
+	bool empty() const { return size() == 0; }
+
+	std::string barcode(size_t i) const { return names.str(i); }
+
+	// The minimizers of barcode i
+	const Mx* begin(size_t i) const { return mxs.data() + offsets[i]; }
+	const Mx* end(size_t i) const { return mxs.data() + offsets[i + 1]; }
+	size_t count(size_t i) const { return offsets[i + 1] - offsets[i]; }
+
+	// The minimizers of all the barcodes
+	const std::vector<Mx>& minimizers() const { return mxs; }
+
+	void clear()
+	{
+		names.clear();
+		offsets.assign(1, 0);
+		mxs.clear();
+	}
+
+	// Read barcodes and minimizers in TSV or the binary format. The minimizers of the records
+	// of a barcode are merged. A barcode may have no minimizers.
+	inline void read(std::istream& is, const std::string& ipath);
+
+	// Keep only the minimizers for which keep(mx) is true. The barcodes are split into ranges of
+	// about as many minimizers, one per thread, and each thread compacts its range in place, so
+	// keep must be thread safe. The ranges are then moved together.
+	template<typename Keep>
+	void filterMxs(Keep keep, unsigned threads = 1)
+	{
+		size_t nranges = std::max(threads, 1U);
+		std::vector<size_t> firsts(nranges + 1, size());
+		std::vector<size_t> starts(nranges + 1, mxs.size());
+		std::vector<size_t> kept(nranges);
+		for (size_t r = 0; r < nranges; ++r) {
+			firsts[r] =
+			    std::lower_bound(offsets.begin(), offsets.end() - 1, mxs.size() * r / nranges) -
+			    offsets.begin();
+			starts[r] = offsets[firsts[r]];
+		}
+#pragma omp parallel for num_threads(nranges) schedule(dynamic)
+		for (size_t r = 0; r < nranges; ++r) {
+			size_t n = starts[r];
+			size_t begin = starts[r];
+			for (size_t i = firsts[r]; i < firsts[r + 1]; ++i) {
+				size_t end = offsets[i + 1];
+				for (size_t j = begin; j < end; ++j) {
+					if (keep(mxs[j])) {
+						mxs[n++] = mxs[j];
+					}
+				}
+				begin = end;
+				offsets[i + 1] = n;
+			}
+			kept[r] = n - starts[r];
+		}
+		size_t n = 0;
+		for (size_t r = 0; r < nranges; ++r) {
+			size_t shift = starts[r] - n;
+			if (shift > 0) {
+				std::move(
+				    mxs.begin() + starts[r], mxs.begin() + starts[r] + kept[r], mxs.begin() + n);
+				for (size_t i = firsts[r]; i < firsts[r + 1]; ++i) {
+					offsets[i + 1] -= shift;
+				}
+			}
+			n += kept[r];
+		}
+		mxs.resize(n);
+		shrink(mxs);
+	}
+
+	// Keep only the barcodes for which keep(i) is true. keep is called for every barcode before
+	// any is moved, so it may look at the minimizers of barcode i.
+	template<typename Keep>
+	void filterBxs(Keep keep)
+	{
+		std::vector<bool> kept(size());
+		for (size_t i = 0; i < size(); ++i) {
+			kept[i] = keep(i);
+		}
+		size_t nbx = 0;
+		for (size_t i = 0; i < kept.size(); ++i) {
+			if (!kept[i]) {
+				continue;
+			}
+			std::copy(begin(i), end(i), mxs.begin() + offsets[nbx]);
+			offsets[nbx + 1] = offsets[nbx] + count(i);
+			++nbx;
+		}
+		offsets.resize(nbx + 1);
+		mxs.resize(offsets.back());
+		shrink(mxs);
+		names.filter(kept);
+	}
+
+	// Write the barcodes and their minimizers in TSV or the binary format.
+	inline void write(std::ostream& os, const std::string& opath, bool binary) const;
+
+  private:
+	BarcodeNames names;
+	std::vector<size_t> offsets{ 0 };
+	std::vector<Mx> mxs;
+
+	using Pending = std::vector<std::pair<uint32_t, Mx>>;
+
+	// Release the memory of a vector that has shrunk to less than half its capacity.
+	template<typename T>
+	static void shrink(std::vector<T>& v)
+	{
+		if (v.size() < v.capacity() / 2) {
+			v.shrink_to_fit();
+		}
+	}
+
+	// Merge the pending minimizers of the barcodes into the arrays.
+	inline void merge(Pending& pending);
+
+	template<typename Mxs>
+	void add(Pending& pending, const char* bx, size_t n, const Mxs& record)
+	{
+		uint32_t id = names.intern(bx, n);
+		for (const auto mx : record) {
+			pending.emplace_back(id, mx);
+		}
+		size_t limit = std::max(BXTOMXS_MERGE_MIN, mxs.size() / BXTOMXS_MERGE_FRACTION);
+		if (pending.size() >= limit) {
+			merge(pending);
+		}
+	}
+};
+
+// Merge from the back, so that the minimizers of a barcode move only toward the end of the array
+// and never overwrite those not yet merged, and then move them all to the front.
+inline void
+BxtoMxs::merge(Pending& pending)
+{
+	std::sort(pending.begin(), pending.end());
+	pending.erase(std::unique(pending.begin(), pending.end()), pending.end());
+	size_t nbx = names.size();
+	offsets.resize(nbx + 1, mxs.size());
+	mxs.resize(mxs.size() + pending.size());
+	size_t pos = mxs.size();
+	size_t next = pos;
+	size_t p = pending.size();
+	for (size_t i = nbx; i-- > 0;) {
+		size_t rowEnd = pos;
+		size_t a = offsets[i];
+		size_t b = offsets[i + 1];
+		while (b > a || (p > 0 && pending[p - 1].first == i)) {
+			Mx mx = 0;
+			bool isPending = p > 0 && pending[p - 1].first == i;
+			if (isPending && (b == a || pending[p - 1].second > mxs[b - 1])) {
+				mx = pending[--p].second;
+			} else {
+				mx = mxs[--b];
+			}
+			if (pos == rowEnd || mxs[pos] != mx) {
+				mxs[--pos] = mx;
+			}
+		}
+		offsets[i + 1] = next;
+		next = pos;
+	}
+	offsets[0] = pos;
+	std::move(mxs.begin() + pos, mxs.end(), mxs.begin());
+	mxs.resize(mxs.size() - pos);
+	for (auto& offset : offsets) {
+		offset -= pos;
+	}
+	pending.clear();
+}
+
+inline void
+BxtoMxs::read(std::istream& is, const std::string& ipath)
+{
+	clear();
+	Pending pending;
+	readMxRecords(is, ipath, [&](const char* bx, size_t n, const std::vector<Mx>& record) {
+		add(pending, bx, n, record);
+	});
+	merge(pending);
+	names.finish();
+}
+
+inline void
+BxtoMxs::write(std::ostream& os, const std::string& opath, bool binary) const
+{
+	MxsWriter writer(os, opath, binary);
+	for (size_t i = 0; i < size(); ++i) {
+		writer.write(names.data(i), names.length(i), begin(i), count(i));
+	}
+}
+
+#endif
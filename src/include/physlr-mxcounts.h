@@ -0,0 +1,187 @@
+#ifndef PHYSLR_MXCOUNTS_H
+#define PHYSLR_MXCOUNTS_H
+
+#include "tsl/robin_map.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <vector>
+
+// Minimizers are partitioned among the shards this many at a time, so that counting needs little
+// more memory than the counts.
+const size_t MXCOUNTS_ROUND = 1 << 24;
+
+// The number of times each minimizer occurs, counted on several threads. The minimizers are
+// radix-partitioned by the high bits of a multiplicative hash into shards, several per thread, so
+// that each shard is counted and filtered by one thread without locking.
+class MxCounts
+{
+
+  public:
+	using Mx = uint64_t;
+	using Shard = tsl::robin_map<Mx, unsigned>;
+
+	explicit MxCounts(unsigned threads = 1)
+	  : threads(std::max(threads, 1U))
+	{
+		if (this->threads > 1) {
+			while ((size_t(1) << bits) < 4 * size_t(this->threads)) {
+				++bits;
+			}
+		}
+		shards.resize(size_t(1) << bits);
+	}
+
+	MxCounts(const MxCounts&) = delete;
+	MxCounts& operator=(const MxCounts&) = delete;
+
+	// The number of distinct minimizers
+	size_t size() const
+	{
+		size_t n = 0;
+		for (const auto& shard : shards) {
+			n += shard.size();
+		}
+		return n;
+	}
+
+	bool empty() const { return size() == 0; }
+
+	void clear()
+	{
+		for (auto& shard : shards) {
+			shard.clear();
+		}
+	}
+
+	// Return the count of a minimizer, or zero if it was not counted. Thread safe.
+	unsigned get(Mx mx) const
+	{
+		const Shard& shard = shards[shardOf(mx)];
+		auto it = shard.find(mx);
+		return it != shard.end() ? it->second : 0;
+	}
+
+	// Count the minimizers.
+	void add(const std::vector<Mx>& mxs)
+	{
+		update(mxs, [](unsigned& count) { ++count; });
+	}
+
+	// Uncount minimizers that were counted, such as those of a barcode that is discarded.
+	void subtract(const std::vector<Mx>& mxs)
+	{
+		update(mxs, [](unsigned& count) { --count; });
+	}
+
+	// Call f(mx, count) for every minimizer.
+	template<typename F>
+	void forEach(F f) const
+	{
+		for (const auto& shard : shards) {
+			for (const auto& item : shard) {
+				f(item.first, item.second);
+			}
+		}
+	}
+
+	// Erase the minimizers whose count erase(count) is true, and return their number.
+	template<typename Erase>
+	size_t eraseIf(Erase erase)
+	{
+		size_t erased = 0;
+#pragma omp parallel for num_threads(threads) schedule(dynamic) reduction(+ : erased)
+		for (size_t s = 0; s < shards.size(); ++s) {
+			Shard& shard = shards[s];
+			for (auto it = shard.begin(); it != shard.end();) {
+				if (erase(it->second)) {
+					++erased;
+					it = shard.erase(it);
+				} else {
+					++it;
+				}
+			}
+		}
+		return erased;
+	}
+
+  private:
+	unsigned threads;
+	unsigned bits = 0;
+	std::vector<Shard> shards;
+
+	size_t shardOf(Mx mx) const
+	{
+		return bits == 0 ? 0 : (mx * 0x9e3779b97f4a7c15) >> (64 - bits);
+	}
+
+	// Call op(count) for the count of each minimizer, each shard on one thread.
+	template<typename Op>
+	void update(const std::vector<Mx>& mxs, Op op)
+	{
+		if (shards.size() == 1) {
+			for (const auto mx : mxs) {
+				op(shards[0][mx]);
+			}
+			return;
+		}
+		std::vector<Mx> partitioned;
+		std::vector<size_t> bounds;
+		for (size_t first = 0; first < mxs.size(); first += MXCOUNTS_ROUND) {
+			size_t last = std::min(mxs.size(), first + MXCOUNTS_ROUND);
+			partition(mxs.data() + first, mxs.data() + last, partitioned, bounds);
+#pragma omp parallel for num_threads(threads) schedule(dynamic)
+			for (size_t s = 0; s < shards.size(); ++s) {
+				Shard& shard = shards[s];
+				for (size_t i = bounds[s]; i < bounds[s + 1]; ++i) {
+					op(shard[partitioned[i]]);
+				}
+			}
+		}
+	}
+
+	// Partition the minimizers from first to last by shard on every thread. The minimizers of
+	// shard s are then partitioned[bounds[s]] up to partitioned[bounds[s + 1]].
+	void partition(
+	    const Mx* first,
+	    const Mx* last,
+	    std::vector<Mx>& partitioned,
+	    std::vector<size_t>& bounds) const
+	{
+		size_t n = last - first;
+		size_t nshards = shards.size();
+		size_t slice = (n + threads - 1) / threads;
+		partitioned.resize(n);
+		bounds.assign(nshards + 1, 0);
+		// The number of minimizers of shard s in slice t, and then where slice t writes them
+		std::vector<size_t> positions(threads * nshards);
+#pragma omp parallel for num_threads(threads)
+		for (size_t t = 0; t < threads; ++t) {
+			size_t* counts = positions.data() + t * nshards;
+			const Mx* end = first + std::min(n, (t + 1) * slice);
+			for (const Mx* p = first + std::min(n, t * slice); p < end; ++p) {
+				++counts[shardOf(*p)];
+			}
+		}
+		size_t pos = 0;
+		for (size_t s = 0; s < nshards; ++s) {
+			bounds[s] = pos;
+			for (size_t t = 0; t < threads; ++t) {
+				size_t count = positions[t * nshards + s];
+				positions[t * nshards + s] = pos;
+				pos += count;
+			}
+		}
+		bounds[nshards] = pos;
+#pragma omp parallel for num_threads(threads)
+		for (size_t t = 0; t < threads; ++t) {
+			size_t* next = positions.data() + t * nshards;
+			const Mx* end = first + std::min(n, (t + 1) * slice);
+			for (const Mx* p = first + std::min(n, t * slice); p < end; ++p) {
+				partitioned[next[shardOf(*p)]++] = *p;
+			}
+		}
+	}
+};
+
+#endif
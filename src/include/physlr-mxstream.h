@@ -0,0 +1,310 @@
+#ifndef PHYSLR_MXSTREAM_H
+#define PHYSLR_MXSTREAM_H
+
+#include "tsl/robin_map.h"
+
+#include <zlib.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <vector>
+
+// A binary stream of barcodes and their minimizers, the compact alternative to the TSV format
+// "barcode\tmx mx ...". The minimizers of a record are a set: they are sorted and unique.
+/* Format
+stream  := header block*            Streams may be concatenated.
+header  := "\x89PLMX\r\n" version   version is the byte 1.
+block   := "MXBK" size:u32 records:u32 crc32:u32 payload[size]
+record  := barcode count:varint minimizer[count]
+barcode := varint                   0 introduces a new barcode: length:varint bytes[length],
+                                    which takes the next ID of the stream, starting from 0.
+                                    Otherwise the ID of a barcode seen before, plus one.
+minimizer := varint                 The first minimizer, then the difference from the previous.
+Integers u32 are little endian, and varints are LEB128. The CRC-32 is of the payload.
+*/
+
+const char MXSTREAM_MAGIC[] = "\x89PLMX\r\n\x01";
+const size_t MXSTREAM_MAGIC_SIZE = 8;
+const char MXSTREAM_BLOCK_MAGIC[] = "MXBK";
+const size_t MXSTREAM_BLOCK_HEADER_SIZE = 16;
+// Records are written in blocks of about this many bytes.
+const size_t MXSTREAM_BLOCK_BYTES = 1 << 20;
+
+static inline void
+mxStreamError(const std::string& path, const std::string& msg)
+{
+	std::cerr << "error: " << msg << ": " << path << '\n';
+	exit(EXIT_FAILURE);
+}
+
+// Return true if the stream is in the binary format rather than TSV, without consuming it.
+// A TSV stream starts with a barcode, which never starts with the first byte of the magic.
+static inline bool
+isMxStream(std::istream& is)
+{
+	return is.peek() == static_cast<unsigned char>(MXSTREAM_MAGIC[0]);
+}
+
+// Write barcodes and minimizers in the binary format.
+class MxWriter
+{
+
+  public:
+	MxWriter(std::ostream& os, std::string path)
+	  : os(os)
+	  , path(std::move(path))
+	{
+		os.write(MXSTREAM_MAGIC, MXSTREAM_MAGIC_SIZE);
+		check();
+		written = MXSTREAM_MAGIC_SIZE;
+	}
+
+	MxWriter(const MxWriter&) = delete;
+	MxWriter& operator=(const MxWriter&) = delete;
+
+	~MxWriter() { flush(); }
+
+	// Append a record. The minimizers must be sorted and unique.
+	void write(const char* bx, size_t bxSize, const uint64_t* mxs, size_t n)
+	{
+		key.assign(bx, bxSize);
+		auto it = barcodes.find(key);
+		if (it == barcodes.end()) {
+			putVarint(0);
+			putVarint(bxSize);
+			payload.insert(payload.end(), bx, bx + bxSize);
+			barcodes.emplace(key, barcodes.size());
+		} else {
+			putVarint(it->second + 1);
+		}
+		putVarint(n);
+		uint64_t prev = 0;
+		for (size_t i = 0; i < n; ++i) {
+			putVarint(mxs[i] - prev);
+			prev = mxs[i];
+		}
+		++records;
+		if (payload.size() >= MXSTREAM_BLOCK_BYTES) {
+			flush();
+		}
+	}
+
+	// Append a record of a barcode and any container of minimizers, such as a set.
+	template<typename Mxs>
+	void write(const std::string& bx, const Mxs& mxs)
+	{
+		sorted.assign(mxs.begin(), mxs.end());
+		std::sort(sorted.begin(), sorted.end());
+		sorted.erase(std::unique(sorted.begin(), sorted.end()), sorted.end());
+		write(bx.data(), bx.size(), sorted.data(), sorted.size());
+	}
+
+	// The number of bytes written so far, including those of records not yet flushed
+	size_t bytes() const { return written + payload.size(); }
+
+	// Write the records appended so far as a block.
+	void flush()
+	{
+		if (records == 0) {
+			return;
+		}
+		char header[MXSTREAM_BLOCK_HEADER_SIZE];
+		std::memcpy(header, MXSTREAM_BLOCK_MAGIC, 4);
+		putU32(header + 4, payload.size());
+		putU32(header + 8, records);
+		putU32(header + 12, crc32(0, payload.data(), payload.size()));
+		os.write(header, sizeof(header));
+		os.write(reinterpret_cast<const char*>(payload.data()), payload.size());
+		check();
+		written += sizeof(header) + payload.size();
+		payload.clear();
+		records = 0;
+	}
+
+  private:
+	std::ostream& os;
+	const std::string path;
+	tsl::robin_map<std::string, uint64_t> barcodes;
+	std::string key;
+	std::vector<uint64_t> sorted;
+	std::vector<unsigned char> payload;
+	size_t records = 0;
+	size_t written = 0;
+
+	void check() const
+	{
+		if (!os.good()) {
+			mxStreamError(path, strerror(errno));
+		}
+	}
+
+	void putVarint(uint64_t x)
+	{
+		while (x >= 0x80) {
+			payload.push_back(static_cast<unsigned char>(x | 0x80));
+			x >>= 7;
+		}
+		payload.push_back(static_cast<unsigned char>(x));
+	}
+
+	static void putU32(char* p, uint32_t x)
+	{
+		for (unsigned i = 0; i < 4; ++i) {
+			p[i] = static_cast<char>(x >> (8 * i));
+		}
+	}
+};
+
+// Read barcodes and minimizers in the binary format.
+class MxReader
+{
+
+  public:
+	MxReader(std::istream& is, std::string path)
+	  : is(is)
+	  , path(std::move(path))
+	{}
+
+	// Read the next record into the ID of its barcode and its sorted minimizers.
+	// Return false at the end of the stream.
+	bool read(size_t& id, std::vector<uint64_t>& mxs)
+	{
+		while (pos >= payload.size()) {
+			if (remaining != 0) {
+				mxStreamError(path, "Corrupt minimizer stream: block has too few records");
+			}
+			if (!readBlock()) {
+				return false;
+			}
+		}
+		if (remaining == 0) {
+			mxStreamError(path, "Corrupt minimizer stream: block has too many records");
+		}
+		--remaining;
+		uint64_t tag = getVarint();
+		if (tag == 0) {
+			uint64_t size = getVarint();
+			if (size > payload.size() - pos) {
+				mxStreamError(path, "Corrupt minimizer stream: barcode extends past block");
+			}
+			barcodes.emplace_back(reinterpret_cast<const char*>(&payload[pos]), size);
+			pos += size;
+			id = barcodes.size() - 1;
+		} else if (tag <= barcodes.size()) {
+			id = tag - 1;
+		} else {
+			mxStreamError(path, "Corrupt minimizer stream: unknown barcode");
+		}
+		uint64_t n = getVarint();
+		if (n > payload.size() - pos) {
+			mxStreamError(path, "Corrupt minimizer stream: minimizers extend past block");
+		}
+		mxs.resize(n);
+		uint64_t mx = 0;
+		for (size_t i = 0; i < n; ++i) {
+			mx += getVarint();
+			mxs[i] = mx;
+		}
+		return true;
+	}
+
+	// Read the next record into its barcode and its sorted minimizers.
+	// Return false at the end of the stream.
+	bool read(std::string& bx, std::vector<uint64_t>& mxs)
+	{
+		size_t id = 0;
+		if (!read(id, mxs)) {
+			return false;
+		}
+		bx = barcodes[id];
+		return true;
+	}
+
+	// The barcode with the given ID in the current stream
+	const std::string& barcode(size_t id) const { return barcodes[id]; }
+
+  private:
+	std::istream& is;
+	const std::string path;
+	std::vector<std::string> barcodes;
+	std::vector<unsigned char> payload;
+	size_t pos = 0;
+	size_t remaining = 0;
+	bool started = false;
+
+	// Read the header of a stream or a block, and the payload of a block.
+	// Return false at the end of the stream.
+	bool readBlock()
+	{
+		char header[MXSTREAM_BLOCK_HEADER_SIZE];
+		while (true) {
+			if (is.peek() == std::char_traits<char>::eof()) {
+				return false;
+			}
+			if (!is.read(header, 4)) {
+				mxStreamError(path, "Truncated minimizer stream");
+			}
+			if (std::memcmp(header, MXSTREAM_BLOCK_MAGIC, 4) == 0) {
+				break;
+			}
+			// A stream header starts the stream, or another stream concatenated to it.
+			if (!is.read(header + 4, MXSTREAM_MAGIC_SIZE - 4)) {
+				mxStreamError(path, "Truncated minimizer stream");
+			}
+			if (std::memcmp(header, MXSTREAM_MAGIC, MXSTREAM_MAGIC_SIZE) != 0) {
+				mxStreamError(path, "Not a minimizer stream or unsupported version");
+			}
+			barcodes.clear();
+			started = true;
+		}
+		if (!started) {
+			mxStreamError(path, "Minimizer stream has no header");
+		}
+		if (!is.read(header + 4, MXSTREAM_BLOCK_HEADER_SIZE - 4)) {
+			mxStreamError(path, "Truncated minimizer stream");
+		}
+		payload.resize(getU32(header + 4));
+		remaining = getU32(header + 8);
+		if (!is.read(reinterpret_cast<char*>(payload.data()), payload.size())) {
+			mxStreamError(path, "Truncated minimizer stream");
+		}
+		if (crc32(0, payload.data(), payload.size()) != getU32(header + 12)) {
+			mxStreamError(path, "Corrupt minimizer stream: checksum mismatch");
+		}
+		pos = 0;
+		return true;
+	}
+
+	uint64_t getVarint()
+	{
+		uint64_t x = 0;
+		for (unsigned shift = 0; shift < 64; shift += 7) {
+			if (pos >= payload.size()) {
+				break;
+			}
+			unsigned char byte = payload[pos++];
+			x |= uint64_t(byte & 0x7f) << shift;
+			if ((byte & 0x80) == 0) {
+				return x;
+			}
+		}
+		mxStreamError(path, "Corrupt minimizer stream: bad integer");
+		return 0;
+	}
+
+	static uint32_t getU32(const char* p)
+	{
+		uint32_t x = 0;
+		for (unsigned i = 0; i < 4; ++i) {
+			x |= uint32_t(static_cast<unsigned char>(p[i])) << (8 * i);
+		}
+		return x;
+	}
+};
+
+#endif
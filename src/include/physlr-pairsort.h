@@ -0,0 +1,275 @@
+#ifndef PHYSLR_PAIRSORT_H
+#define PHYSLR_PAIRSORT_H
+
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <queue>
+#include <string>
+#include <vector>
+
+// A minimizer and the number of a barcode that has it
+struct MxBx
+{
+	uint64_t mx;
+	uint32_t bx;
+};
+
+// Order pairs by minimizer and then barcode.
+struct ByMx
+{
+	bool operator()(const MxBx& a, const MxBx& b) const
+	{
+		return a.mx < b.mx || (a.mx == b.mx && a.bx < b.bx);
+	}
+};
+
+// Order pairs by barcode and then minimizer.
+struct ByBx
+{
+	bool operator()(const MxBx& a, const MxBx& b) const
+	{
+		return a.bx < b.bx || (a.bx == b.bx && a.mx < b.mx);
+	}
+};
+
+// Sort pairs of minimizers and barcodes in a limited amount of memory, and remove duplicates.
+// When the pairs in memory exceed the memory limit, they are sorted and written to a temporary
+// file in $TMPDIR as a run, and the runs are merged when the pairs are read back.
+template<typename Less>
+class PairSorter
+{
+
+  public:
+	explicit PairSorter(size_t memoryLimit)
+	  : capacity(std::max(memoryLimit / sizeof(MxBx), size_t(1)))
+	{
+		// Reserve the memory limit up front, so that push_back never doubles past it.
+		pairs.reserve(capacity);
+	}
+
+	PairSorter(const PairSorter&) = delete;
+	PairSorter& operator=(const PairSorter&) = delete;
+
+	~PairSorter()
+	{
+		for (const auto& run : runs) {
+			std::remove(run->path.c_str());
+		}
+	}
+
+	void push(const MxBx& pair)
+	{
+		pairs.push_back(pair);
+		if (pairs.size() >= capacity) {
+			spill();
+		}
+	}
+
+	// Stop adding pairs, and start reading them back in order.
+	inline void sort();
+
+	// Read the next pair in order. Return false after the last pair.
+	inline bool next(MxBx& pair);
+
+	// The number of runs written to temporary files
+	size_t spilled() const { return runs.size(); }
+
+  private:
+	// A sorted run in a temporary file, read back a buffer at a time
+	struct Run
+	{
+		std::string path;
+		std::ifstream ifs;
+		std::vector<MxBx> buffer;
+		size_t pos = 0;
+
+		// Return the next pair, or false at the end of the run.
+		bool next(MxBx& pair)
+		{
+			if (pos == buffer.size()) {
+				buffer.resize(buffer.capacity());
+				ifs.read(reinterpret_cast<char*>(buffer.data()), buffer.size() * sizeof(MxBx));
+				buffer.resize(ifs.gcount() / sizeof(MxBx));
+				pos = 0;
+				if (buffer.empty()) {
+					return false;
+				}
+			}
+			pair = buffer[pos++];
+			return true;
+		}
+	};
+
+	// The current pair of each run, ordered so that the heap holds the least at its top
+	struct HeapLess
+	{
+		const std::vector<MxBx>* heads;
+
+		bool operator()(size_t a, size_t b) const { return Less()((*heads)[b], (*heads)[a]); }
+	};
+
+	size_t capacity;
+	std::vector<MxBx> pairs;
+	std::vector<std::unique_ptr<Run>> runs;
+	size_t pos = 0;
+	std::vector<MxBx> heads;
+	std::priority_queue<size_t, std::vector<size_t>, HeapLess> heap{ HeapLess{ &heads } };
+	bool started = false;
+	MxBx last{ 0, 0 };
+
+	static bool equal(const MxBx& a, const MxBx& b) { return a.mx == b.mx && a.bx == b.bx; }
+
+	// Sort and deduplicate the pairs in memory.
+	void sortPairs()
+	{
+		std::sort(pairs.begin(), pairs.end(), Less());
+		pairs.erase(std::unique(pairs.begin(), pairs.end(), equal), pairs.end());
+	}
+
+	// Write the pairs in memory to a temporary file as a sorted run, and clear them, keeping
+	// their memory reserved for the next run.
+	inline void spill();
+
+	// Return the least pair of the runs, or false when they are all read.
+	bool nextMerged(MxBx& pair)
+	{
+		if (heap.empty()) {
+			return false;
+		}
+		size_t r = heap.top();
+		heap.pop();
+		pair = heads[r];
+		if (runs[r]->next(heads[r])) {
+			heap.push(r);
+		}
+		return true;
+	}
+};
+
+template<typename Less>
+inline void
+PairSorter<Less>::spill()
+{
+	const char* tmpdir = std::getenv("TMPDIR");
+	std::string path =
+	    std::string(tmpdir != nullptr ? tmpdir : "/tmp") + "/physlr-filter.XXXXXX";
+	int fd = mkstemp(&path[0]);
+	if (fd < 0) {
+		std::cerr << "error: " << std::strerror(errno) << ": " << path << '\n';
+		exit(EXIT_FAILURE);
+	}
+	close(fd);
+	runs.emplace_back(new Run());
+	runs.back()->path = path;
+	sortPairs();
+	std::ofstream ofs(path, std::ios::binary);
+	ofs.write(reinterpret_cast<const char*>(pairs.data()), pairs.size() * sizeof(MxBx));
+	ofs.flush();
+	if (!ofs.good()) {
+		std::cerr << "error: " << std::strerror(errno) << ": " << path << '\n';
+		exit(EXIT_FAILURE);
+	}
+	pairs.clear();
+}
+
+template<typename Less>
+inline void
+PairSorter<Less>::sort()
+{
+	if (runs.empty()) {
+		sortPairs();
+		return;
+	}
+	// Spill the rest too, so that the buffers of the runs may use all the memory.
+	if (!pairs.empty()) {
+		spill();
+	}
+	std::vector<MxBx>().swap(pairs);
+	size_t bufferSize = std::max(capacity / runs.size(), size_t(1) << 12);
+	heads.resize(runs.size());
+	for (size_t r = 0; r < runs.size(); ++r) {
+		Run& run = *runs[r];
+		run.ifs.open(run.path, std::ios::binary);
+		if (!run.ifs.good()) {
+			std::cerr << "error: " << std::strerror(errno) << ": " << run.path << '\n';
+			exit(EXIT_FAILURE);
+		}
+		run.buffer.reserve(bufferSize);
+		if (run.next(heads[r])) {
+			heap.push(r);
+		}
+	}
+}
+
+template<typename Less>
+inline bool
+PairSorter<Less>::next(MxBx& pair)
+{
+	if (runs.empty()) {
+		if (pos == pairs.size()) {
+			std::vector<MxBx>().swap(pairs);
+			return false;
+		}
+		pair = pairs[pos++];
+		return true;
+	}
+	// The runs are each free of duplicates, but may share pairs.
+	do {
+		if (!nextMerged(pair)) {
+			return false;
+		}
+	} while (started && equal(pair, last));
+	started = true;
+	last = pair;
+	return true;
+}
+
+// Read pairs sorted by minimizer, and call f(mx, bxs) for each minimizer with the sorted
+// barcodes that have it.
+template<typename F>
+static inline void
+forEachMx(PairSorter<ByMx>& sorter, F f)
+{
+	std::vector<uint32_t> bxs;
+	MxBx pair{ 0, 0 };
+	bool more = sorter.next(pair);
+	while (more) {
+		uint64_t mx = pair.mx;
+		bxs.clear();
+		do {
+			bxs.push_back(pair.bx);
+			more = sorter.next(pair);
+		} while (more && pair.mx == mx);
+		f(mx, bxs);
+	}
+}
+
+// Read pairs sorted by barcode, and call f(bx, mxs) for each barcode with its sorted minimizers.
+template<typename F>
+static inline void
+forEachBx(PairSorter<ByBx>& sorter, F f)
+{
+	std::vector<uint64_t> mxs;
+	MxBx pair{ 0, 0 };
+	bool more = sorter.next(pair);
+	while (more) {
+		uint32_t bx = pair.bx;
+		mxs.clear();
+		do {
+			mxs.push_back(pair.mx);
+			more = sorter.next(pair);
+		} while (more && pair.bx == bx);
+		f(bx, mxs);
+	}
+}
+
+#endif
@@ -1,5 +1,7 @@
-#include "tsl/robin_map.h"
-#include "tsl/robin_set.h"
+#include "physlr-bxtomxs.h"
+#include "physlr-mxcounts.h"
+#include "physlr-mxstream.h"
+#include "physlr-pairsort.h"
 #include <algorithm>
 #include <cassert>
 #include <chrono>
@@ -42,61 +44,48 @@ static void
 printUsage(const std::string& progname)
 {
 	std::cout << "Usage:  " << progname
-	          << "  -n n -N N [-s] [-o file] file...\n\n"
+	          << "  -n n -N N [-s] [-t N] [--memory-limit=M] [-o file] file...\n\n"
 	             "  -s         silent; disable verbose output\n"
 	             "  -o file    write output to file, default is stdout\n"
+	             "  -t N       use N number of threads [1]\n"
+	             "  --binary   write the binary minimizer stream format rather than TSV\n"
 	             "  -n         minimum number of minimizers per barcode\n"
 	             "  -N         maximum number of minimizers per barcode\n"
+	             "  --memory-limit=M  filter in external memory, holding about M MiB of\n"
+	             "             minimizers in memory and the rest in temporary files in $TMPDIR\n"
+	             "             (not counting the names and sizes of the barcodes)\n"
 	             "  --help     display this help and exit\n"
 	             "  file       space separated list of FASTQ files\n";
 }
 
-using Mx = uint64_t;
-using Mxs = tsl::robin_set<Mx>;
-using Bx = std::string;
-using BxtoMxs = tsl::robin_map<Bx, Mxs>;
-using MxtoCounts = tsl::robin_map<Mx, unsigned>;
+using Mx = BxtoMxs::Mx;
 
-static BxtoMxs
-readMxs(std::istream& is, const std::string& ipath, bool silent)
+static void
+readMxs(std::istream& is, const std::string& ipath, bool silent, BxtoMxs& bxtomxs)
 {
 	if (is.peek() == std::ifstream::traits_type::eof()) {
 		std::cerr << "physlr-filterbarcodes: error: Empty input file: " << ipath << '\n';
 		exit(EXIT_FAILURE);
 	}
-	BxtoMxs bxtomxs;
-	Bx bx;
-	std::string mx;
-	std::string mx_line;
-	while ((is >> bx) && (getline(is, mx_line))) {
-		std::istringstream iss(mx_line);
-		while (iss >> mx) {
-			bxtomxs[bx].insert(strtoull(mx.c_str(), nullptr, 0));
-		}
-	}
+	bxtomxs.read(is, ipath);
+	// A barcode without minimizers is as if it were not read.
+	bxtomxs.filterBxs([&](size_t i) { return bxtomxs.count(i) > 0; });
 	auto t = std::chrono::steady_clock::now();
 	auto diff = std::chrono::duration_cast<std::chrono::milliseconds>(t - t0);
 	if (!silent) {
 		std::cerr << "Time at readMxs (ms): " << diff.count() << '\n';
 	}
-	return bxtomxs;
 }
 
 static void
-writeMxs(BxtoMxs bxtomxs, std::ostream& os, const std::string& opath, bool silent)
+writeMxs(
+    const BxtoMxs& bxtomxs,
+    std::ostream& os,
+    const std::string& opath,
+    bool binary,
+    bool silent)
 {
-	for (const auto& item : bxtomxs) {
-		const auto& bx = item.first;
-		const auto& mxs = item.second;
-		os << bx;
-		char sep = '\t';
-		for (const auto& mx : mxs) {
-			os << sep << mx;
-			sep = ' ';
-		}
-		os << '\n';
-		assert_good(os, opath);
-	}
+	bxtomxs.write(os, opath, binary);
 	auto t = std::chrono::steady_clock::now();
 	auto diff = std::chrono::duration_cast<std::chrono::milliseconds>(t - t0);
 	if (!silent) {
@@ -104,56 +93,33 @@ writeMxs(BxtoMxs bxtomxs, std::ostream& os, const std::string& opath, bool silen
 	}
 }
 
-static MxtoCounts
-countMxs(const BxtoMxs& bxtomxs, bool silent)
+static void
+countMxs(const BxtoMxs& bxtomxs, MxCounts& counts, bool silent)
 {
-	MxtoCounts counts;
-	for (const auto& item : bxtomxs) {
-		const auto& mxs = item.second;
-		for (const auto& mx : mxs) {
-			if (counts.find(mx) == counts.end()) {
-				counts[mx] = 1;
-			} else {
-				++counts[mx];
-			}
-		}
-	}
+	counts.add(bxtomxs.minimizers());
 	auto t = std::chrono::steady_clock::now();
 	auto diff = std::chrono::duration_cast<std::chrono::milliseconds>(t - t0);
 	if (!silent) {
 		std::cerr << "Time at countMxs (ms): " << diff.count() << '\n';
 	}
-	return counts;
 }
 
 static void
-removeSingletonMxs(BxtoMxs& bxtomxs, bool silent)
+removeSingletonMxs(BxtoMxs& bxtomxs, unsigned threads, bool silent)
 {
-	MxtoCounts counts = countMxs(bxtomxs, silent);
+	MxCounts counts(threads);
+	countMxs(bxtomxs, counts, silent);
 	std::cerr << "Counted " << counts.size() << " minimizers." << '\n';
-	Mxs uniqueMxs;
-	uint64_t singletons = 0;
-	tsl::robin_map<Mx, bool> counted;
-	for (const auto& item : bxtomxs) {
-		Mxs not_singletons;
-		not_singletons.reserve(item.second.size());
-		for (const auto& mx : item.second) {
-			if (counts[mx] >= 2) {
-				not_singletons.insert(mx);
-			} else {
-				++singletons;
-			}
-		}
-		uniqueMxs.insert(item.second.begin(), item.second.end()); // need to do before removing!
-		bxtomxs[item.first] = std::move(not_singletons);
-	}
+	bxtomxs.filterMxs([&](Mx mx) { return counts.get(mx) >= 2; }, threads);
+	size_t singletons = 0;
+	counts.forEach([&](Mx, unsigned count) { singletons += count < 2; });
 	auto t = std::chrono::steady_clock::now();
 	auto diff = std::chrono::duration_cast<std::chrono::milliseconds>(t - t0);
 	if (!silent) {
 		std::cerr << "Time at removeSingletonMxs (ms): " << diff.count() << '\n';
 		std::cerr << "Removed " << singletons << " minimizers that occur once of "
-		          << uniqueMxs.size() << " (" << std::setprecision(1) << std::fixed
-		          << 100.0 * singletons / uniqueMxs.size() << "%)\n";
+		          << counts.size() << " (" << std::setprecision(1) << std::fixed
+		          << 100.0 * singletons / counts.size() << "%)\n";
 	}
 }
 
@@ -165,31 +131,134 @@ physlr_filterbarcodes(
     const std::string& opath,
     const size_t n,
     const size_t N,
+    unsigned threads,
+    bool binary,
     bool silent)
 {
 	if (is.peek() == std::ifstream::traits_type::eof()) {
 		std::cerr << "physlr-filterbarcodes: error: Empty input file: " << ipath << '\n';
 		exit(EXIT_FAILURE);
 	}
-	BxtoMxs bxtomxs = readMxs(is, ipath, silent);
+	BxtoMxs bxtomxs;
+	readMxs(is, ipath, silent, bxtomxs);
 	unsigned initial_size = bxtomxs.size();
-	removeSingletonMxs(bxtomxs, silent);
+	removeSingletonMxs(bxtomxs, threads, silent);
 	unsigned too_few = 0, too_many = 0;
 	std::cerr << "There are " << initial_size << " barcodes." << '\n';
-	for (auto it = bxtomxs.begin(); it != bxtomxs.end();) {
-		auto& mxs = it->second;
-		if (mxs.size() < n) {
+	bxtomxs.filterBxs([&](size_t i) {
+		if (bxtomxs.count(i) < n) {
 			++too_few;
-			it = bxtomxs.erase(it);
-		} else if (mxs.size() >= N) {
+			return false;
+		}
+		if (bxtomxs.count(i) >= N) {
 			++too_many;
-			it = bxtomxs.erase(it);
-		} else {
-			++it;
+			return false;
 		}
+		return true;
+	});
+	auto t = std::chrono::steady_clock::now();
+	auto diff = std::chrono::duration_cast<std::chrono::milliseconds>(t - t0);
+	if (!silent) {
+		std::cerr << "Time at filterbarcodes (ms): " << diff.count() << '\n';
+		std::cerr << "Discarded " << too_few << " barcodes with too few minimizers of "
+		          << initial_size << " (" << std::setprecision(1) << std::fixed
+		          << 100.0 * too_few / initial_size << "%)\n";
+		std::cerr << "Discarded " << too_many << " barcodes with too many minimizers of "
+		          << initial_size << " (" << std::setprecision(1) << std::fixed
+		          << 100.0 * too_many / initial_size << "%)\n";
+		std::cerr << "Wrote " << initial_size - too_few - too_many << " barcodes\n";
+	}
+	writeMxs(bxtomxs, os, opath, binary, silent);
+}
+
+// Filter the barcodes as physlr_filterbarcodes does, with the same output, holding about
+// memoryLimit bytes of minimizers in memory. The pairs of minimizers and barcodes are sorted by
+// minimizer in external memory to count the minimizers, and then by barcode to write them.
+static void
+physlr_filterbarcodes_external(
+    std::istream& is,
+    const std::string& ipath,
+    std::ostream& os,
+    const std::string& opath,
+    const size_t n,
+    const size_t N,
+    size_t memoryLimit,
+    bool binary,
+    bool silent)
+{
+	if (is.peek() == std::ifstream::traits_type::eof()) {
+		std::cerr << "physlr-filterbarcodes: error: Empty input file: " << ipath << '\n';
+		exit(EXIT_FAILURE);
 	}
+	// Each sorter holds half of the memory, since one is read while the next is written.
+	BarcodeNames names;
+	std::unique_ptr<PairSorter<ByMx>> byMx(new PairSorter<ByMx>(memoryLimit / 2));
+	readMxRecords(is, ipath, [&](const char* bx, size_t len, const std::vector<Mx>& record) {
+		uint32_t id = names.intern(bx, len);
+		for (const auto mx : record) {
+			byMx->push({ mx, id });
+		}
+	});
+	names.finish();
+	byMx->sort();
 	auto t = std::chrono::steady_clock::now();
 	auto diff = std::chrono::duration_cast<std::chrono::milliseconds>(t - t0);
+	if (!silent) {
+		std::cerr << "Time at readMxs (ms): " << diff.count() << '\n';
+	}
+
+	// A barcode without minimizers is as if it were not read.
+	std::vector<bool> read(names.size());
+	std::vector<uint32_t> sizes(names.size());
+	PairSorter<ByBx> byBx(memoryLimit / 2);
+	size_t counted = 0, singletons = 0;
+	forEachMx(*byMx, [&](Mx mx, const std::vector<uint32_t>& bxs) {
+		++counted;
+		for (const auto bx : bxs) {
+			read[bx] = true;
+		}
+		if (bxs.size() < 2) {
+			++singletons;
+			return;
+		}
+		for (const auto bx : bxs) {
+			++sizes[bx];
+			byBx.push({ mx, bx });
+		}
+	});
+	byMx.reset();
+	byBx.sort();
+	t = std::chrono::steady_clock::now();
+	diff = std::chrono::duration_cast<std::chrono::milliseconds>(t - t0);
+	if (!silent) {
+		std::cerr << "Time at countMxs (ms): " << diff.count() << '\n';
+	}
+	std::cerr << "Counted " << counted << " minimizers." << '\n';
+	if (!silent) {
+		std::cerr << "Time at removeSingletonMxs (ms): " << diff.count() << '\n';
+		std::cerr << "Removed " << singletons << " minimizers that occur once of " << counted
+		          << " (" << std::setprecision(1) << std::fixed << 100.0 * singletons / counted
+		          << "%)\n";
+	}
+
+	unsigned initial_size = std::count(read.begin(), read.end(), true);
+	unsigned too_few = 0, too_many = 0;
+	std::cerr << "There are " << initial_size << " barcodes." << '\n';
+	std::vector<bool> kept(names.size());
+	for (size_t i = 0; i < names.size(); ++i) {
+		if (!read[i]) {
+			continue;
+		}
+		if (sizes[i] < n) {
+			++too_few;
+		} else if (sizes[i] >= N) {
+			++too_many;
+		} else {
+			kept[i] = true;
+		}
+	}
+	t = std::chrono::steady_clock::now();
+	diff = std::chrono::duration_cast<std::chrono::milliseconds>(t - t0);
 	if (!silent) {
 		std::cerr << "Time at filterbarcodes (ms): " << diff.count() << '\n';
 		std::cerr << "Discarded " << too_few << " barcodes with too few minimizers of "
@@ -200,7 +269,18 @@ physlr_filterbarcodes(
 		          << 100.0 * too_many / initial_size << "%)\n";
 		std::cerr << "Wrote " << initial_size - too_few - too_many << " barcodes\n";
 	}
-	writeMxs(bxtomxs, os, opath, silent);
+
+	MxsWriter writer(os, opath, binary);
+	forEachBx(byBx, [&](uint32_t bx, const std::vector<Mx>& mxs) {
+		if (kept[bx]) {
+			writer.write(names.data(bx), names.length(bx), mxs.data(), mxs.size());
+		}
+	});
+	t = std::chrono::steady_clock::now();
+	diff = std::chrono::duration_cast<std::chrono::milliseconds>(t - t0);
+	if (!silent) {
+		std::cerr << "Time at writeMxs (ms): " << diff.count() << '\n';
+	}
 }
 
 int
@@ -213,15 +293,24 @@ main(int argc, char* argv[])
 	static int help = 0;
 	unsigned n = 0;
 	unsigned N = 0;
+	unsigned t = 1;
+	size_t memoryLimit = 0;
+	const int OPT_MEMORY_LIMIT = 256;
 	bool silent = false;
 	bool failed = false;
 	bool n_set = false;
 	bool N_set = false;
 	char* end = nullptr;
 	std::string outfile("/dev/stdout");
+	static int binary = 0;
 	static const struct option longopts[] = { { "help", no_argument, &help, 1 },
+		                                      { "binary", no_argument, &binary, 1 },
+		                                      { "memory-limit",
+		                                        required_argument,
+		                                        nullptr,
+		                                        OPT_MEMORY_LIMIT },
 		                                      { nullptr, 0, nullptr, 0 } };
-	while ((c = getopt_long(argc, argv, "o:s:n:N:", longopts, &optindex)) != -1) {
+	while ((c = getopt_long(argc, argv, "o:s:n:N:t:", longopts, &optindex)) != -1) {
 		switch (c) {
 		case 0:
 			break;
@@ -239,6 +328,16 @@ main(int argc, char* argv[])
 			N_set = true;
 			N = strtoul(optarg, &end, 10);
 			break;
+		case 't':
+			t = strtoul(optarg, &end, 10);
+			break;
+		case OPT_MEMORY_LIMIT:
+			memoryLimit = strtoull(optarg, &end, 10);
+			if (*end != '\0' || memoryLimit == 0) {
+				printErrorMsg(progname, "option has incorrect argument -- 'memory-limit'");
+				exit(EXIT_FAILURE);
+			}
+			break;
 		default:
 			exit(EXIT_FAILURE);
 		}
@@ -266,6 +365,10 @@ main(int argc, char* argv[])
 		printErrorMsg(progname, "option has incorrect argument -- 'N'");
 		failed = true;
 	}
+	if (t == 0) {
+		printErrorMsg(progname, "option has incorrect argument -- 't'");
+		failed = true;
+	}
 	if (infiles.empty()) {
 		printErrorMsg(progname, "missing file operand");
 		failed = true;
@@ -281,7 +384,12 @@ main(int argc, char* argv[])
 		}
 		std::ifstream ifs(infile);
 		assert_good(ifs, infile);
-		physlr_filterbarcodes(ifs, infile, ofs, outfile, n, N, silent);
+		if (memoryLimit > 0) {
+			physlr_filterbarcodes_external(
+			    ifs, infile, ofs, outfile, n, N, memoryLimit << 20, binary != 0, silent);
+		} else {
+			physlr_filterbarcodes(ifs, infile, ofs, outfile, n, N, t, binary != 0, silent);
+		}
 	}
 	ofs.flush();
 	assert_good(ofs, outfile);
@@ -1,5 +1,7 @@
-#include "tsl/robin_map.h"
-#include "tsl/robin_set.h"
+#include "physlr-bxtomxs.h"
+#include "physlr-mxcounts.h"
+#include "physlr-mxstream.h"
+#include "physlr-pairsort.h"
 #include <algorithm>
 #include <cassert>
 #include <cfenv>
@@ -16,6 +18,7 @@
 #include <iterator>
 #include <limits>
 #include <map>
+#include <memory>
 #include <sstream>
 #include <string>
 #include <unordered_map>
@@ -44,21 +47,27 @@ static void
 printUsage(const std::string& progname)
 {
 	std::cout << "Usage:  " << progname
-	          << "  -n n -N N [-s] [-o file] file...\n\n"
+	          << "  -n n -N N [-s] [-t N] [--memory-limit=M] [--filtered-barcodes=file] [-o file]"
+	             " file...\n\n"
 	             "  -s         silent; disable verbose output\n"
 	             "  -o file    write output to file, default is stdout\n"
+	             "  -t N       use N number of threads [1]\n"
+	             "  --binary   write the binary minimizer stream format rather than TSV\n"
 	             "  -n         minimum number of minimizers per barcode\n"
 	             "  -N         maximum number of minimizers per barcode\n"
 	             "  -C         maximum minimizer multiplicity\n"
+	             "  --fixed-point  discard barcodes outside -n and -N and then minimizers that\n"
+	             "             occur once until no barcode is discarded\n"
+	             "  --memory-limit=M  filter in external memory, holding about M MiB of\n"
+	             "             minimizers in memory and the rest in temporary files in $TMPDIR\n"
+	             "             (not counting the names and sizes of the barcodes)\n"
+	             "  --filtered-barcodes=file  also write the barcodes filtered by -n and -N, as\n"
+	             "             physlr-filter-barcodes does, to file\n"
 	             "  --help     display this help and exit\n"
 	             "  file       space separated list of FASTQ files\n";
 }
 
-using Mx = uint64_t;
-using Mxs = tsl::robin_set<Mx>;
-using Bx = std::string;
-using BxtoMxs = tsl::robin_map<Bx, Mxs>;
-using MxtoCount = tsl::robin_map<Mx, unsigned>;
+using Mx = BxtoMxs::Mx;
 
 static void
 readMxs(std::istream& is, const std::string& ipath, bool silent, BxtoMxs& bxtomxs)
@@ -68,21 +77,7 @@ readMxs(std::istream& is, const std::string& ipath, bool silent, BxtoMxs& bxtomx
 		          << '\n';
 		exit(EXIT_FAILURE);
 	}
-	bxtomxs.clear();
-	assert(bxtomxs.empty());
-	Bx bx;
-	std::string mx_string;
-	std::string mx_line;
-	std::istringstream iss;
-	while ((is >> bx) && (getline(is, mx_line))) {
-		iss.clear();
-		iss.str(mx_line);
-		auto& mxs = bxtomxs[bx];
-		while (iss >> mx_string) {
-			Mx mx = strtoull(mx_string.c_str(), nullptr, 0);
-			mxs.insert(mx);
-		}
-	}
+	bxtomxs.read(is, ipath);
 	if (!silent) {
 		auto t = std::chrono::steady_clock::now();
 		auto diff = std::chrono::duration_cast<std::chrono::milliseconds>(t - t0);
@@ -92,20 +87,14 @@ readMxs(std::istream& is, const std::string& ipath, bool silent, BxtoMxs& bxtomx
 }
 
 static void
-writeMxs(BxtoMxs bxtomxs, std::ostream& os, const std::string& opath, bool silent)
+writeMxs(
+    const BxtoMxs& bxtomxs,
+    std::ostream& os,
+    const std::string& opath,
+    bool binary,
+    bool silent)
 {
-	for (const auto& item : bxtomxs) {
-		const auto& bx = item.first;
-		const auto& mxs = item.second;
-		os << bx;
-		char sep = '\t';
-		for (const auto& mx : mxs) {
-			os << sep << mx;
-			sep = ' ';
-		}
-		os << '\n';
-		assert_good(os, opath);
-	}
+	bxtomxs.write(os, opath, binary);
 	auto t = std::chrono::steady_clock::now();
 	auto diff = std::chrono::duration_cast<std::chrono::milliseconds>(t - t0);
 	if (!silent) {
@@ -115,20 +104,11 @@ writeMxs(BxtoMxs bxtomxs, std::ostream& os, const std::string& opath, bool silen
 }
 
 static void
-countMxs(const BxtoMxs& bxtomxs, MxtoCount& counts, bool silent)
+countMxs(const BxtoMxs& bxtomxs, MxCounts& counts, bool silent)
 {
 	counts.clear();
 	assert(counts.empty());
-	for (const auto& item : bxtomxs) {
-		const auto& mxs = item.second;
-		for (const auto& mx : mxs) {
-			if (counts.find(mx) == counts.end()) {
-				counts[mx] = 1;
-			} else {
-				++counts[mx];
-			}
-		}
-	}
+	counts.add(bxtomxs.minimizers());
 	auto t = std::chrono::steady_clock::now();
 	auto diff = std::chrono::duration_cast<std::chrono::milliseconds>(t - t0);
 	if (!silent) {
@@ -138,59 +118,60 @@ countMxs(const BxtoMxs& bxtomxs, MxtoCount& counts, bool silent)
 }
 
 static void
-removeSingletonMxs(BxtoMxs& bxtomxs, MxtoCount& counts, bool silent)
+removeSingletonMxs(BxtoMxs& bxtomxs, MxCounts& counts, unsigned threads, bool silent)
 {
-	countMxs(bxtomxs, counts, silent);
 	assert(!counts.empty() && !bxtomxs.empty());
-	Mxs singletons;
-	for (auto it = bxtomxs.begin(); it != bxtomxs.end(); ++it) {
-		const auto& bx = it->first;
-		auto& mxs = it->second;
-		Mxs not_singletons;
-		not_singletons.reserve(mxs.size());
-		for (const auto& mx : mxs) {
-			if (counts[mx] >= 2) {
-				not_singletons.insert(mx);
-			} else {
-				singletons.insert(mx);
-			}
-		}
-		bxtomxs[bx] = std::move(not_singletons);
-	}
-	for (auto it = counts.begin(); it != counts.end();) {
-		if (it->second < 2) {
-			it = counts.erase(it);
-		} else {
-			++it;
-		}
-	}
+	bxtomxs.filterMxs([&](Mx mx) { return counts.get(mx) >= 2; }, threads);
+	size_t singletons = counts.eraseIf([](unsigned count) { return count < 2; });
 	if (!silent) {
 		auto t = std::chrono::steady_clock::now();
 		auto diff = std::chrono::duration_cast<std::chrono::milliseconds>(t - t0);
 		std::cerr << "Time after removing singleton minimizers (ms): " << diff.count() << '\n';
-		std::cerr << "Removed " << singletons.size() << " minimizers that occur once of "
+		std::cerr << "Removed " << singletons << " minimizers that occur once of "
 		          << counts.size() << " (" << std::setprecision(1) << std::fixed
-		          << 100.0 * singletons.size() / counts.size() << "%)\n\n";
+		          << 100.0 * singletons / counts.size() << "%)\n\n";
 	}
 }
 
+// Discard the barcodes for which discard(i) is true, and subtract their minimizers from the
+// counts rather than counting the minimizers of the remaining barcodes again. Minimizers that no
+// longer occur are erased from the counts.
+template<typename Discard>
+static void
+discardBarcodes(BxtoMxs& bxtomxs, MxCounts& counts, Discard discard)
+{
+	std::vector<Mx> discarded;
+	bxtomxs.filterBxs([&](size_t i) {
+		if (!discard(i)) {
+			return true;
+		}
+		discarded.insert(discarded.end(), bxtomxs.begin(i), bxtomxs.end(i));
+		if (discarded.size() >= MXCOUNTS_ROUND) {
+			counts.subtract(discarded);
+			discarded.clear();
+		}
+		return false;
+	});
+	counts.subtract(discarded);
+	counts.eraseIf([](unsigned count) { return count == 0; });
+}
+
 static void
-filter_barcodes(const size_t n, const size_t N, bool silent, BxtoMxs& bxtomxs)
+filter_barcodes(const size_t n, const size_t N, bool silent, BxtoMxs& bxtomxs, MxCounts& counts)
 {
 	unsigned initial_size = bxtomxs.size();
 	unsigned too_few = 0, too_many = 0;
-	for (auto it = bxtomxs.begin(); it != bxtomxs.end();) {
-		const auto& mxs = it->second;
-		if (mxs.size() < n) {
+	discardBarcodes(bxtomxs, counts, [&](size_t i) {
+		if (bxtomxs.count(i) < n) {
 			++too_few;
-			it = bxtomxs.erase(it);
-		} else if (mxs.size() >= N) {
+			return true;
+		}
+		if (bxtomxs.count(i) >= N) {
 			++too_many;
-			it = bxtomxs.erase(it);
-		} else {
-			++it;
+			return true;
 		}
-	}
+		return false;
+	});
 	if (!silent) {
 		auto t = std::chrono::steady_clock::now();
 		auto diff = std::chrono::duration_cast<std::chrono::milliseconds>(t - t0);
@@ -218,57 +199,374 @@ quantile(std::vector<float> quantiles, std::vector<unsigned> values)
 	return qs;
 }
 
+// Remove the minimizers that occur at least C times, by default the high whisker of their
+// counts, and the barcodes left empty.
 static void
-filter_minimizers(bool silent, BxtoMxs& bxtomxs, MxtoCount counts, unsigned C)
+filter_minimizers(bool silent, BxtoMxs& bxtomxs, MxCounts& counts, unsigned C, unsigned threads)
 {
 	std::vector<unsigned> values;
 	values.reserve(counts.size());
-	for (auto& item : counts) {
-		values.push_back(item.second);
-	}
+	counts.forEach([&](Mx, unsigned count) { values.push_back(count); });
 	std::vector<float> q = { 0.25, 0.5, 0.75 };
 	q = quantile(q, values);
 	unsigned high_whisker = int(q[2] + 1.5 * (q[2] - q[0]));
 	if (C == 0) {
 		C = high_whisker;
 	}
-	Mxs repetitives;
 	unsigned empty = 0;
 	unsigned bx_size = bxtomxs.size();
-	for (auto it = bxtomxs.begin(); it != bxtomxs.end();) {
-		auto& bx = it->first;
-		auto mxs = it->second;
-		Mxs not_repetitives;
-		not_repetitives.reserve(mxs.size());
-		for (const auto& mx : mxs) {
-			if (counts[mx] < C) {
-				not_repetitives.insert(mx);
-			} else {
-				repetitives.insert(mx);
-			}
-		}
-		bxtomxs[bx] = std::move(not_repetitives);
-		mxs = it->second;
-		if (mxs.empty()) {
+	size_t mx_size = counts.size();
+	bxtomxs.filterMxs([&](Mx mx) { return counts.get(mx) < C; }, threads);
+	size_t repetitives = counts.eraseIf([&](unsigned count) { return count >= C; });
+	bxtomxs.filterBxs([&](size_t i) {
+		if (bxtomxs.count(i) == 0) {
 			++empty;
-			it = bxtomxs.erase(it);
-		} else {
-			++it;
+			return false;
 		}
-	}
+		return true;
+	});
 	if (!silent) {
 		auto t = std::chrono::steady_clock::now();
 		auto diff = std::chrono::duration_cast<std::chrono::milliseconds>(t - t0);
 		std::cerr << "Time after removing repetitive minimizers (ms): " << diff.count() << '\n';
 		std::cerr << "Minimizer frequency: Q1=" << q[0] << " Q2=" << q[1] << " Q3=" << q[2]
 		          << " C= " << C << '\n';
-		std::cerr << "Removed " << repetitives.size() << " most frequent minimizers of "
-		          << counts.size() << '\n';
+		std::cerr << "Removed " << repetitives << " most frequent minimizers of " << mx_size
+		          << '\n';
 		std::cerr << "Removed " << empty << " empty barcodes of " << bx_size << '\n';
 		std::cerr << "There are " << bxtomxs.size() << " barcodes remaining." << '\n';
 	}
 }
 
+// Discard the barcodes with fewer than n or at least N minimizers, and then the minimizers that
+// now occur fewer than twice, until no barcode is discarded. Counts only decrease, so no
+// minimizer comes to occur at least C times.
+static void
+filter_fixed_point(
+    const size_t n,
+    const size_t N,
+    bool silent,
+    BxtoMxs& bxtomxs,
+    MxCounts& counts,
+    unsigned threads)
+{
+	for (unsigned round = 1;; ++round) {
+		size_t discarded = 0;
+		discardBarcodes(bxtomxs, counts, [&](size_t i) {
+			bool discard = bxtomxs.count(i) < n || bxtomxs.count(i) >= N;
+			discarded += discard;
+			return discard;
+		});
+		if (discarded == 0) {
+			break;
+		}
+		bxtomxs.filterMxs([&](Mx mx) { return counts.get(mx) >= 2; }, threads);
+		size_t singletons = counts.eraseIf([](unsigned count) { return count < 2; });
+		if (!silent) {
+			std::cerr << "Round " << round << ": discarded " << discarded
+			          << " barcodes and then " << singletons
+			          << " minimizers that occur once\n";
+		}
+	}
+	if (!silent) {
+		auto t = std::chrono::steady_clock::now();
+		auto diff = std::chrono::duration_cast<std::chrono::milliseconds>(t - t0);
+		std::cerr << "Time after filtering to a fixed point (ms): " << diff.count() << '\n';
+		std::cerr << "There are " << bxtomxs.size() << " barcodes remaining." << '\n';
+	}
+}
+
+// The quantiles of values given by their histogram, where hist[c] is the number of values equal
+// to c, as quantile finds them from the values themselves
+static std::vector<float>
+quantileOfHistogram(const std::vector<float>& quantiles, const std::vector<uint64_t>& hist)
+{
+	uint64_t total = 0;
+	for (const auto count : hist) {
+		total += count;
+	}
+	std::vector<float> qs;
+	qs.reserve(quantiles.size());
+	std::fesetround(FE_TONEAREST);
+	for (const auto& p : quantiles) {
+		uint64_t k = total > 0 ? uint64_t(std::nearbyint(p * (total - 1))) : 0;
+		size_t c = 0;
+		for (uint64_t seen = 0; c < hist.size(); ++c) {
+			seen += hist[c];
+			if (seen > k) {
+				break;
+			}
+		}
+		qs.push_back(c < hist.size() ? c : 0);
+	}
+	return qs;
+}
+
+// Read pairs sorted by minimizer from in, dropping those of barcodes that are not kept, and push
+// to out the pairs of the minimizers for which keep(count) is true of the number of kept barcodes
+// that have them. Count in sizes the minimizers of each barcode pushed to out, and return the
+// number of minimizers that occur in any kept barcode. Push every pair of a kept barcode to tee,
+// unless null.
+template<typename Keep>
+static size_t
+filterPairs(
+    PairSorter<ByMx>& in,
+    PairSorter<ByMx>& out,
+    const std::vector<bool>& kept,
+    std::vector<uint32_t>& sizes,
+    Keep keep,
+    PairSorter<ByBx>* tee = nullptr)
+{
+	std::fill(sizes.begin(), sizes.end(), 0);
+	size_t occurring = 0;
+	std::vector<uint32_t> bxs;
+	forEachMx(in, [&](Mx mx, const std::vector<uint32_t>& all) {
+		bxs.clear();
+		for (const auto bx : all) {
+			if (kept[bx]) {
+				bxs.push_back(bx);
+				if (tee != nullptr) {
+					tee->push({ mx, bx });
+				}
+			}
+		}
+		if (bxs.empty()) {
+			return;
+		}
+		++occurring;
+		if (!keep(bxs.size())) {
+			return;
+		}
+		for (const auto bx : bxs) {
+			++sizes[bx];
+			out.push({ mx, bx });
+		}
+	});
+	out.sort();
+	return occurring;
+}
+
+// Filter as the in-memory steps do, with the same output, holding about memoryLimit bytes of
+// minimizers in memory. Each step is a pass over the pairs of minimizers and barcodes sorted by
+// minimizer in external memory, which writes the pairs it keeps for the next step, and the
+// remaining pairs are sorted by barcode to write them.
+static void
+filter_external(
+    std::istream& is,
+    const std::string& ipath,
+    std::ostream& os,
+    const std::string& opath,
+    std::ostream* bxos,
+    const std::string& bxpath,
+    const size_t n,
+    const size_t N,
+    unsigned C,
+    bool fixed_point,
+    size_t memoryLimit,
+    bool binary,
+    bool silent)
+{
+	if (is.peek() == std::ifstream::traits_type::eof()) {
+		std::cerr << "physlr-filter-barcodes-minimizers: error: Empty input file: " << ipath
+		          << '\n';
+		exit(EXIT_FAILURE);
+	}
+	using Sorter = PairSorter<ByMx>;
+	// Each sorter holds half of the memory, since one is read while the next is written, or a
+	// third while the barcodes filtered by -n and -N are also sorted.
+	size_t sorterMemory = memoryLimit / (bxos != nullptr ? 3 : 2);
+	auto newSorter = [&]() { return std::unique_ptr<Sorter>(new Sorter(sorterMemory)); };
+	auto elapsed = []() {
+		auto t = std::chrono::steady_clock::now();
+		return std::chrono::duration_cast<std::chrono::milliseconds>(t - t0).count();
+	};
+	BarcodeNames names;
+	std::unique_ptr<Sorter> pairs = newSorter();
+	readMxRecords(is, ipath, [&](const char* bx, size_t len, const std::vector<Mx>& record) {
+		uint32_t id = names.intern(bx, len);
+		for (const auto mx : record) {
+			pairs->push({ mx, id });
+		}
+	});
+	names.finish();
+	pairs->sort();
+	if (!silent) {
+		std::cerr << "Time after reading minimizers (ms): " << elapsed() << '\n';
+		std::cerr << "Read " << names.size() << " barcodes.\n\n";
+	}
+
+	std::vector<bool> kept(names.size(), true);
+	std::vector<uint32_t> sizes(names.size());
+	std::unique_ptr<Sorter> next = newSorter();
+	size_t singletons = 0;
+	size_t counted = filterPairs(*pairs, *next, kept, sizes, [&](size_t count) {
+		singletons += count < 2;
+		return count >= 2;
+	});
+	pairs.swap(next);
+	next.reset();
+	if (!silent) {
+		std::cerr << "Time after counting minimizers (ms): " << elapsed() << '\n';
+		std::cerr << "Counted " << counted << " minimizers.\n\n";
+	}
+	assert(counted > 0 && names.size() > 0);
+	if (!silent) {
+		std::cerr << "Time after removing singleton minimizers (ms): " << elapsed() << '\n';
+		std::cerr << "Removed " << singletons << " minimizers that occur once of "
+		          << counted - singletons << " (" << std::setprecision(1) << std::fixed
+		          << 100.0 * singletons / (counted - singletons) << "%)\n\n";
+	}
+
+	unsigned initial_size = names.size();
+	unsigned too_few = 0, too_many = 0;
+	for (size_t i = 0; i < names.size(); ++i) {
+		if (sizes[i] < n) {
+			++too_few;
+			kept[i] = false;
+		} else if (sizes[i] >= N) {
+			++too_many;
+			kept[i] = false;
+		}
+	}
+	size_t remaining = initial_size - too_few - too_many;
+	if (!silent) {
+		std::cerr << "Time after filtering barcodes (ms): " << elapsed() << '\n';
+		std::cerr << "Discarded " << too_few << " barcodes with too few minimizers of "
+		          << initial_size << " (" << std::setprecision(1) << std::fixed
+		          << 100.0 * too_few / initial_size << "%)\n";
+		std::cerr << "Discarded " << too_many << " barcodes with too many minimizers of "
+		          << initial_size << " (" << std::setprecision(1) << std::fixed
+		          << 100.0 * too_many / initial_size << "%)\n";
+		std::cerr << "There are " << remaining << " barcodes remaining\n\n";
+	}
+
+	// The histogram of the counts of the minimizers that occur at least twice
+	std::vector<uint64_t> hist;
+	std::unique_ptr<PairSorter<ByBx>> filtered;
+	if (bxos != nullptr) {
+		filtered.reset(new PairSorter<ByBx>(sorterMemory));
+	}
+	next = newSorter();
+	singletons = 0;
+	counted = filterPairs(
+	    *pairs,
+	    *next,
+	    kept,
+	    sizes,
+	    [&](size_t count) {
+		    if (count < 2) {
+			    ++singletons;
+			    return false;
+		    }
+		    if (count >= hist.size()) {
+			    hist.resize(count + 1);
+		    }
+		    ++hist[count];
+		    return true;
+	    },
+	    filtered.get());
+	pairs.swap(next);
+	next.reset();
+	if (filtered) {
+		filtered->sort();
+		MxsWriter writer(*bxos, bxpath, binary);
+		forEachBx(*filtered, [&](uint32_t bx, const std::vector<Mx>& mxs) {
+			writer.write(names.data(bx), names.length(bx), mxs.data(), mxs.size());
+		});
+		filtered.reset();
+		if (!silent) {
+			std::cerr << "Wrote " << remaining << " barcodes to " << bxpath << ".\n\n";
+		}
+	}
+	assert(counted > 0 && remaining > 0);
+	if (!silent) {
+		std::cerr << "Time after removing singleton minimizers (ms): " << elapsed() << '\n';
+		std::cerr << "Removed " << singletons << " minimizers that occur once of "
+		          << counted - singletons << " (" << std::setprecision(1) << std::fixed
+		          << 100.0 * singletons / (counted - singletons) << "%)\n\n";
+	}
+
+	std::vector<float> q = { 0.25, 0.5, 0.75 };
+	q = quantileOfHistogram(q, hist);
+	unsigned high_whisker = int(q[2] + 1.5 * (q[2] - q[0]));
+	if (C == 0) {
+		C = high_whisker;
+	}
+	size_t mx_size = counted - singletons;
+	size_t repetitives = 0;
+	next = newSorter();
+	filterPairs(*pairs, *next, kept, sizes, [&](size_t count) {
+		repetitives += count >= C;
+		return count < C;
+	});
+	pairs.swap(next);
+	next.reset();
+	unsigned empty = 0;
+	for (size_t i = 0; i < names.size(); ++i) {
+		if (kept[i] && sizes[i] == 0) {
+			++empty;
+			kept[i] = false;
+		}
+	}
+	if (!silent) {
+		std::cerr << "Time after removing repetitive minimizers (ms): " << elapsed() << '\n';
+		std::cerr << "Minimizer frequency: Q1=" << q[0] << " Q2=" << q[1] << " Q3=" << q[2]
+		          << " C= " << C << '\n';
+		std::cerr << "Removed " << repetitives << " most frequent minimizers of " << mx_size
+		          << '\n';
+		std::cerr << "Removed " << empty << " empty barcodes of " << remaining << '\n';
+		std::cerr << "There are " << remaining - empty << " barcodes remaining." << '\n';
+	}
+	remaining -= empty;
+
+	for (unsigned round = 1; fixed_point; ++round) {
+		size_t discarded = 0;
+		for (size_t i = 0; i < names.size(); ++i) {
+			if (kept[i] && (sizes[i] < n || sizes[i] >= N)) {
+				++discarded;
+				kept[i] = false;
+			}
+		}
+		if (discarded == 0) {
+			break;
+		}
+		remaining -= discarded;
+		next = newSorter();
+		singletons = 0;
+		filterPairs(*pairs, *next, kept, sizes, [&](size_t count) {
+			singletons += count < 2;
+			return count >= 2;
+		});
+		pairs.swap(next);
+		next.reset();
+		if (!silent) {
+			std::cerr << "Round " << round << ": discarded " << discarded
+			          << " barcodes and then " << singletons
+			          << " minimizers that occur once\n";
+		}
+	}
+	if (fixed_point && !silent) {
+		std::cerr << "Time after filtering to a fixed point (ms): " << elapsed() << '\n';
+		std::cerr << "There are " << remaining << " barcodes remaining." << '\n';
+	}
+
+	PairSorter<ByBx> byBx(memoryLimit / 2);
+	MxBx pair{ 0, 0 };
+	while (pairs->next(pair)) {
+		byBx.push(pair);
+	}
+	pairs.reset();
+	byBx.sort();
+	MxsWriter writer(os, opath, binary);
+	forEachBx(byBx, [&](uint32_t bx, const std::vector<Mx>& mxs) {
+		writer.write(names.data(bx), names.length(bx), mxs.data(), mxs.size());
+	});
+	if (!silent) {
+		std::cerr << "Time after writing minimizers (ms): " << elapsed() << '\n';
+		std::cerr << "Wrote " << remaining << " barcodes.\n\n";
+	}
+}
+
 int
 main(int argc, char* argv[])
 {
@@ -279,6 +577,11 @@ main(int argc, char* argv[])
 	static int help = 0;
 	unsigned n = 0;
 	unsigned N = 0;
+	unsigned t = 1;
+	size_t memoryLimit = 0;
+	const int OPT_MEMORY_LIMIT = 256;
+	const int OPT_FILTERED_BARCODES = 257;
+	std::string bxfile;
 	unsigned C = 0;
 	bool silent = false;
 	bool failed = false;
@@ -286,9 +589,21 @@ main(int argc, char* argv[])
 	bool N_set = false;
 	char* end = nullptr;
 	std::string outfile("/dev/stdout");
+	static int binary = 0;
+	static int fixed_point = 0;
 	static const struct option longopts[] = { { "help", no_argument, &help, 1 },
+		                                      { "binary", no_argument, &binary, 1 },
+		                                      { "fixed-point", no_argument, &fixed_point, 1 },
+		                                      { "memory-limit",
+		                                        required_argument,
+		                                        nullptr,
+		                                        OPT_MEMORY_LIMIT },
+		                                      { "filtered-barcodes",
+		                                        required_argument,
+		                                        nullptr,
+		                                        OPT_FILTERED_BARCODES },
 		                                      { nullptr, 0, nullptr, 0 } };
-	while ((c = getopt_long(argc, argv, "o:s:n:N:C:", longopts, &optindex)) != -1) {
+	while ((c = getopt_long(argc, argv, "o:s:n:N:C:t:", longopts, &optindex)) != -1) {
 		switch (c) {
 		case 0:
 			break;
@@ -309,6 +624,19 @@ main(int argc, char* argv[])
 		case 'C':
 			C = strtoul(optarg, &end, 10);
 			break;
+		case 't':
+			t = strtoul(optarg, &end, 10);
+			break;
+		case OPT_MEMORY_LIMIT:
+			memoryLimit = strtoull(optarg, &end, 10);
+			if (*end != '\0' || memoryLimit == 0) {
+				printErrorMsg(progname, "option has incorrect argument -- 'memory-limit'");
+				exit(EXIT_FAILURE);
+			}
+			break;
+		case OPT_FILTERED_BARCODES:
+			bxfile.assign(optarg);
+			break;
 		default:
 			exit(EXIT_FAILURE);
 		}
@@ -336,6 +664,10 @@ main(int argc, char* argv[])
 		printErrorMsg(progname, "option has incorrect argument -- 'N'");
 		failed = true;
 	}
+	if (t == 0) {
+		printErrorMsg(progname, "option has incorrect argument -- 't'");
+		failed = true;
+	}
 	if (infiles.empty()) {
 		printErrorMsg(progname, "missing file operand");
 		failed = true;
@@ -345,22 +677,58 @@ main(int argc, char* argv[])
 	}
 	std::ofstream ofs(outfile);
 	assert_good(ofs, outfile);
+	std::unique_ptr<std::ofstream> bxofs;
+	if (!bxfile.empty()) {
+		bxofs.reset(new std::ofstream(bxfile));
+		assert_good(*bxofs, bxfile);
+	}
 	for (auto& infile : infiles) {
 		if (infile == "-") {
 			infile = "/dev/stdin";
 		}
 		std::ifstream ifs(infile);
 		assert_good(ifs, infile);
+		if (memoryLimit > 0) {
+			filter_external(
+			    ifs,
+			    infile,
+			    ofs,
+			    outfile,
+			    bxofs.get(),
+			    bxfile,
+			    n,
+			    N,
+			    C,
+			    fixed_point != 0,
+			    memoryLimit << 20,
+			    binary != 0,
+			    silent);
+			continue;
+		}
 		BxtoMxs bxtomxs;
-		MxtoCount counts;
+		MxCounts counts(t);
 		readMxs(ifs, infile, silent, bxtomxs);
-		removeSingletonMxs(bxtomxs, counts, silent);
-		filter_barcodes(n, N, silent, bxtomxs);
-		removeSingletonMxs(bxtomxs, counts, silent);
-		filter_minimizers(silent, bxtomxs, counts, C);
-		writeMxs(bxtomxs, ofs, outfile, silent);
+		countMxs(bxtomxs, counts, silent);
+		removeSingletonMxs(bxtomxs, counts, t, silent);
+		filter_barcodes(n, N, silent, bxtomxs, counts);
+		if (bxofs) {
+			bxtomxs.write(*bxofs, bxfile, binary != 0);
+			if (!silent) {
+				std::cerr << "Wrote " << bxtomxs.size() << " barcodes to " << bxfile << ".\n\n";
+			}
+		}
+		removeSingletonMxs(bxtomxs, counts, t, silent);
+		filter_minimizers(silent, bxtomxs, counts, C, t);
+		if (fixed_point != 0) {
+			filter_fixed_point(n, N, silent, bxtomxs, counts, t);
+		}
+		writeMxs(bxtomxs, ofs, outfile, binary != 0, silent);
 	}
 	ofs.flush();
 	assert_good(ofs, outfile);
+	if (bxofs) {
+		bxofs->flush();
+		assert_good(*bxofs, bxfile);
+	}
 	return 0;
 }
@@ -7,6 +7,9 @@
 #include "btl_bloomfilter/BloomFilter.hpp"
 #include "indexlr-workers.h"
 
+#include <sys/stat.h>
+
+#include <algorithm>
 #include <cassert>
 #include <cstdlib>
 #include <cstring>
@@ -15,55 +18,129 @@
 #include <getopt.h>
 #include <iostream>
 #include <limits>
+#include <memory>
 #include <sstream>
 #include <string>
 #include <vector>
 
-// Read a FASTQ file and reduce each read to a set of minimizers
+// Read FASTQ files and reduce each read to a set of minimizers
 static void
 minimizeReads(
-    const std::string& ipath,
-    const std::string& opath,
-    const size_t k,
-    const size_t w,
+    const std::vector<std::string>& ipaths,
+    const std::vector<std::string>& opaths,
+    const std::vector<MinimizerParams>& params,
     const size_t t,
     const bool withRepeat,
     const bool withSolid,
     const bool withPositions,
     const bool withStrands,
+    const bool binary,
     const bool verbose,
+    const RollNtHash roll,
     const BloomFilter& rBloomFilter,
-    const BloomFilter& sBloomFilter)
+    const BloomFilter& sBloomFilter,
+    BarcodeAggregator* aggregator,
+    MinimizerSketch* sketch,
+    const size_t concurrentFiles,
+    const bool fileOrder,
+    const size_t pieceLength,
+    const bool unordered,
+    const bool withStats,
+    const double statsInterval)
 {
-	InputWorker inputWorker(ipath);
-	OutputWorker outputWorker(opath, inputWorker);
+	// The first pass of --auto-filter only counts the minimizers.
+	const bool output = sketch == nullptr || !sketch->isCounting();
+	// The threads reading files share the threads of decompression.
+	size_t readers = std::max<size_t>(1, std::min(concurrentFiles, ipaths.size()));
+	PipelineStats stats(readers, t);
+	// A sequence is split in pieces only for a single pair of k and w.
+	InputWorker inputWorker(
+	    ipaths,
+	    readers,
+	    std::max<size_t>(1, t / readers),
+	    fileOrder,
+	    params[0].k,
+	    params[0].w,
+	    params.size() == 1 ? pieceLength : 0,
+	    stats.input);
+	// The aggregator writes the output once all the input files are read.
+	OutputWorker outputWorker(opaths, binary, stats.output[0]);
 
+	if (withStats || statsInterval > 0) {
+		stats.watch("input", inputWorker.buffer);
+		stats.watch("output", outputWorker.buffer);
+		stats.start(statsInterval);
+	}
 	inputWorker.start();
-	outputWorker.start();
+	if (output && aggregator == nullptr) {
+		outputWorker.start();
+	}
 
-	auto minimizeWorkers = std::vector<MinimizeWorker>(
-	    t,
-	    MinimizeWorker(
-	        k,
-	        w,
-	        withRepeat,
-	        withSolid,
-	        withPositions,
-	        withStrands,
-	        verbose,
-	        rBloomFilter,
-	        sBloomFilter,
-	        inputWorker,
-	        outputWorker));
+	std::vector<MinimizeWorker> minimizeWorkers;
+	minimizeWorkers.reserve(t);
+	for (size_t i = 0; i < t; ++i) {
+		minimizeWorkers.emplace_back(
+		    params,
+		    withRepeat,
+		    withSolid,
+		    withPositions,
+		    withStrands,
+		    binary,
+		    verbose,
+		    roll,
+		    rBloomFilter,
+		    sBloomFilter,
+		    inputWorker,
+		    output && aggregator == nullptr ? &outputWorker : nullptr,
+		    output ? aggregator : nullptr,
+		    sketch,
+		    unordered,
+		    stats.minimize[i]);
+	}
 	for (auto& worker : minimizeWorkers) {
 		worker.start();
 	}
 	for (auto& worker : minimizeWorkers) {
 		worker.join();
 	}
-
 	inputWorker.join();
-	outputWorker.join();
+	if (output && aggregator == nullptr) {
+		outputWorker.buffer.close();
+		outputWorker.join();
+	}
+	stats.stop();
+	if (withStats) {
+		stats.write(std::cerr, output ? "minimize" : "count");
+	}
+}
+
+// Parse a comma-separated list of positive integers. Return false if it is malformed.
+static bool
+parseList(const char* arg, std::vector<size_t>& values)
+{
+	values.clear();
+	char* end = nullptr;
+	do {
+		values.push_back(strtoul(arg, &end, 10));
+		if (end == arg || values.back() == 0) {
+			return false;
+		}
+		arg = end + 1;
+	} while (*end == ',');
+	return *end == '\0';
+}
+
+// Split a comma-separated list of strings.
+static std::vector<std::string>
+splitList(const std::string& arg)
+{
+	std::vector<std::string> values;
+	std::stringstream ss(arg);
+	std::string value;
+	while (std::getline(ss, value, ',')) {
+		values.push_back(value);
+	}
+	return values;
 }
 
 static void
@@ -72,20 +149,79 @@ printErrorMsg(const std::string& progname, const std::string& msg)
 	std::cerr << progname << ": " << msg << "\nTry 'physlr-indexlr --help' for more information.\n";
 }
 
+// Map a Bloom filter file into memory, shared with other processes that load it.
+static void
+loadBloomFilter(
+    const std::string& progname,
+    const std::string& name,
+    const std::string& path,
+    const bool populate,
+    const bool hugepages,
+    BloomFilter& bloomFilter)
+{
+	std::cerr << "Loading " << name << " Bloom filter from " << path << std::endl;
+	try {
+		bloomFilter.mapFilter(path, populate, hugepages);
+	} catch (const std::exception& e) {
+		std::cerr << e.what() << '\n';
+	}
+	// The bits of an element of a blocked filter all derive from one hash value.
+	if (bloomFilter.getHashNum() != 1 && !bloomFilter.isBlocked()) {
+		printErrorMsg(progname, "the " + name + " Bloom filter must use one hash function");
+		exit(EXIT_FAILURE);
+	}
+	std::cerr << "Finished loading " << name << " Bloom filter" << std::endl;
+}
+
 static void
 printUsage(const std::string& progname)
 {
 	std::cout << "Usage:  " << progname
 	          << "  -k K -w W [-r repeat_bf_path] [-s solid_bf_path] [-v] [-o FILE] FILE...\n\n"
-	             "  -k K        use K as k-mer size\n"
-	             "  -w W        use W as sliding-window size\n"
+	             "  -k K        use K as k-mer size, or a comma-separated list of sizes\n"
+	             "  -w W        use W as sliding-window size, or a comma-separated list of sizes,\n"
+	             "              which pair up with those of -k. The k-mers of a read are hashed\n"
+	             "              once for every W of the same K.\n"
 	             "  -r repeat_bf_path  use a Bloom filter to filter out repetitive minimizers\n"
 	             "  -s solid_bf_path  use a Bloom filter to only select solid minimizers\n"
+	             "  --populate  read the Bloom filters into memory at startup rather than on\n"
+	             "              first use\n"
+	             "  --hugepages advise the kernel to back the Bloom filters with huge pages\n"
+	             "  --auto-filter  count the minimizers of the reads in a first pass, and keep\n"
+	             "              only those counted from the solid to below the repeat threshold\n"
+	             "              in a second pass. The input files are read twice.\n"
+	             "  --auto-filter-memory=M  count the minimizers in M MiB of memory (default\n"
+	             "              1024)\n"
+	             "  --repeat-threshold=N  drop minimizers counted N or more times, at most 255\n"
+	             "              (default 3 times the mode minimizer count)\n"
+	             "  --solid-threshold=N  drop minimizers counted fewer than N times, at most 255\n"
+	             "              (default the first local minimum of the histogram of minimizer\n"
+	             "              counts)\n"
 	             "  --pos       include minimizer positions in the output\n"
 	             "  --strand    include minimizer strand in the output\n"
+	             "  --binary    write the binary minimizer stream format rather than TSV\n"
+	             "  --aggregate write one line per barcode of its sorted unique minimizers,\n"
+	             "              merged from all its reads, rather than one line per read\n"
+	             "  --aggregate-memory=M  spill aggregated barcodes to temporary files in\n"
+	             "              $TMPDIR when they use more than M MiB of memory (default 4096)\n"
 	             "  -v          enable verbose output\n"
-	             "  -o FILE     write output to FILE, default is stdout\n"
-	             "  -t N        use N number of threads (default 1, max 5)\n"
+	             "  -o FILE     write output to FILE, default is stdout, or with several pairs of\n"
+	             "              K and W, to a comma-separated list of files, one per pair\n"
+	             "  -t N        use N number of threads (default 1)\n"
+	             "  --concurrent-files=N  read up to N input files at the same time (default 4)\n"
+	             "  --interleave-files  interleave the reads of the files read at the same time\n"
+	             "              in the output, rather than writing the reads of each input file\n"
+	             "              after those of the previous file\n"
+	             "  --unordered write the reads in the order they are minimized rather than in\n"
+	             "              input order, so that a long read does not hold up the others\n"
+	             "  --piece-length=N  minimize a sequence of more than N k-mers in pieces of N\n"
+	             "              k-mers on all the threads (default 1048576)\n"
+	             "  --stats     write the counters of the threads and the occupancy of the\n"
+	             "              buffers of the pipeline to stderr as JSON when it finishes\n"
+	             "  --stats-interval=N  write the progress of the pipeline to stderr as one line\n"
+	             "              of JSON every N seconds\n"
+	             "  --simd=MODE hash k-mers with the SIMD instruction set MODE: auto, scalar,\n"
+	             "              avx2 or avx512 (default auto, the widest supported by this CPU)\n"
 	             "  --help      display this help and exit\n"
 	             "  FILE        space separated list of FASTQ files\n";
 }
@@ -97,23 +233,89 @@ main(int argc, char* argv[])
 	int c;
 	int optindex = 0;
 	static int help = 0;
-	unsigned k = 0;
-	unsigned w = 0;
+	std::vector<size_t> ks;
+	std::vector<size_t> ws;
 	bool verbose = false;
 	bool withRepeat = false;
 	bool withSolid = false;
 	BloomFilter repeatBF;
 	BloomFilter solidBF;
+	std::string repeatPath;
+	std::string solidPath;
+	static int populate = 0;
+	static int hugepages = 0;
 	unsigned t = 1;
 	bool failed = false;
 	bool w_set = false;
 	bool k_set = false;
 	static int withPositions = 0;
 	static int withStrands = 0;
+	static int binary = 0;
+	static int aggregate = 0;
+	static int interleaveFiles = 0;
+	static int unordered = 0;
+	static int autoFilter = 0;
+	static int withStats = 0;
+	double statsInterval = 0;
+	size_t autoFilterMemory = 1024;
+	unsigned repeatThreshold = 0;
+	unsigned solidThreshold = 0;
+	size_t concurrentFiles = 4;
+	size_t pieceLength = 1 << 20;
+	size_t aggregateMemory = 4096;
 	char* end = nullptr;
-	std::string outfile("/dev/stdout");
+	std::string outfile;
+	std::string simd("auto");
+	const int OPT_SIMD = 256;
+	const int OPT_AGGREGATE_MEMORY = 257;
+	const int OPT_CONCURRENT_FILES = 258;
+	const int OPT_AUTO_FILTER_MEMORY = 259;
+	const int OPT_REPEAT_THRESHOLD = 260;
+	const int OPT_SOLID_THRESHOLD = 261;
+	const int OPT_PIECE_LENGTH = 262;
+	const int OPT_STATS_INTERVAL = 263;
 	static const struct option longopts[] = { { "pos", no_argument, &withPositions, 1 },
 		                                      { "strand", no_argument, &withStrands, 1 },
+		                                      { "binary", no_argument, &binary, 1 },
+		                                      { "aggregate", no_argument, &aggregate, 1 },
+		                                      { "aggregate-memory",
+		                                        required_argument,
+		                                        nullptr,
+		                                        OPT_AGGREGATE_MEMORY },
+		                                      { "concurrent-files",
+		                                        required_argument,
+		                                        nullptr,
+		                                        OPT_CONCURRENT_FILES },
+		                                      { "interleave-files",
+		                                        no_argument,
+		                                        &interleaveFiles,
+		                                        1 },
+		                                      { "unordered", no_argument, &unordered, 1 },
+		                                      { "piece-length",
+		                                        required_argument,
+		                                        nullptr,
+		                                        OPT_PIECE_LENGTH },
+		                                      { "populate", no_argument, &populate, 1 },
+		                                      { "hugepages", no_argument, &hugepages, 1 },
+		                                      { "auto-filter", no_argument, &autoFilter, 1 },
+		                                      { "auto-filter-memory",
+		                                        required_argument,
+		                                        nullptr,
+		                                        OPT_AUTO_FILTER_MEMORY },
+		                                      { "repeat-threshold",
+		                                        required_argument,
+		                                        nullptr,
+		                                        OPT_REPEAT_THRESHOLD },
+		                                      { "solid-threshold",
+		                                        required_argument,
+		                                        nullptr,
+		                                        OPT_SOLID_THRESHOLD },
+		                                      { "stats", no_argument, &withStats, 1 },
+		                                      { "stats-interval",
+		                                        required_argument,
+		                                        nullptr,
+		                                        OPT_STATS_INTERVAL },
+		                                      { "simd", required_argument, nullptr, OPT_SIMD },
 		                                      { "help", no_argument, &help, 1 },
 		                                      { nullptr, 0, nullptr, 0 } };
 	while ((c = getopt_long(argc, argv, "k:w:o:vt:r:s:", longopts, &optindex)) != -1) {
@@ -122,11 +324,15 @@ main(int argc, char* argv[])
 			break;
 		case 'k':
 			k_set = true;
-			k = strtoul(optarg, &end, 10);
+			if (!parseList(optarg, ks)) {
+				ks.clear();
+			}
 			break;
 		case 'w':
 			w_set = true;
-			w = strtoul(optarg, &end, 10);
+			if (!parseList(optarg, ws)) {
+				ws.clear();
+			}
 			break;
 		case 'o':
 			outfile.assign(optarg);
@@ -137,46 +343,72 @@ main(int argc, char* argv[])
 		case 't':
 			t = strtoul(optarg, &end, 10);
 			break;
-		case 'r': {
-			withRepeat = true;
-			std::cerr << "Loading repeat Bloom filter from " << optarg << std::endl;
-			try {
-				repeatBF.loadFilter(optarg);
-			} catch (const std::exception& e) {
-				std::cerr << e.what() << '\n';
+		case OPT_SIMD:
+			simd.assign(optarg);
+			break;
+		case OPT_AGGREGATE_MEMORY:
+			aggregateMemory = strtoull(optarg, &end, 10);
+			if (*end != '\0' || aggregateMemory == 0) {
+				printErrorMsg(progname, "option has incorrect argument -- 'aggregate-memory'");
+				exit(EXIT_FAILURE);
 			}
-			std::cerr << "Finished loading repeat Bloom filter" << std::endl;
 			break;
-		}
-		case 's': {
-			withSolid = true;
-			std::cerr << "Loading solid Bloom filter from " << optarg << std::endl;
-			try {
-				solidBF.loadFilter(optarg);
-			} catch (const std::exception& e) {
-				std::cerr << e.what() << '\n';
+		case OPT_CONCURRENT_FILES:
+			concurrentFiles = strtoull(optarg, &end, 10);
+			if (*end != '\0' || concurrentFiles == 0) {
+				printErrorMsg(progname, "option has incorrect argument -- 'concurrent-files'");
+				exit(EXIT_FAILURE);
 			}
-			std::cerr << "Finished loading solid Bloom filter" << std::endl;
 			break;
-		}
+		case OPT_PIECE_LENGTH:
+			pieceLength = strtoull(optarg, &end, 10);
+			if (*end != '\0' || pieceLength == 0) {
+				printErrorMsg(progname, "option has incorrect argument -- 'piece-length'");
+				exit(EXIT_FAILURE);
+			}
+			break;
+		case OPT_STATS_INTERVAL:
+			statsInterval = strtod(optarg, &end);
+			if (*end != '\0' || !(statsInterval > 0)) {
+				printErrorMsg(progname, "option has incorrect argument -- 'stats-interval'");
+				exit(EXIT_FAILURE);
+			}
+			break;
+		case OPT_AUTO_FILTER_MEMORY:
+			autoFilterMemory = strtoull(optarg, &end, 10);
+			if (*end != '\0' || autoFilterMemory == 0) {
+				printErrorMsg(progname, "option has incorrect argument -- 'auto-filter-memory'");
+				exit(EXIT_FAILURE);
+			}
+			break;
+		case OPT_REPEAT_THRESHOLD:
+			repeatThreshold = strtoul(optarg, &end, 10);
+			if (*end != '\0' || repeatThreshold == 0 ||
+			    repeatThreshold > MinimizerSketch::MAX_COUNT) {
+				printErrorMsg(progname, "option has incorrect argument -- 'repeat-threshold'");
+				exit(EXIT_FAILURE);
+			}
+			break;
+		case OPT_SOLID_THRESHOLD:
+			solidThreshold = strtoul(optarg, &end, 10);
+			if (*end != '\0' || solidThreshold == 0 ||
+			    solidThreshold > MinimizerSketch::MAX_COUNT) {
+				printErrorMsg(progname, "option has incorrect argument -- 'solid-threshold'");
+				exit(EXIT_FAILURE);
+			}
+			break;
+		case 'r':
+			withRepeat = true;
+			repeatPath.assign(optarg);
+			break;
+		case 's':
+			withSolid = true;
+			solidPath.assign(optarg);
+			break;
 		default:
 			exit(EXIT_FAILURE);
 		}
 	}
-	if (t > 5 && !(withSolid || withRepeat)) {
-		t = 5;
-		std::cerr
-		    << progname
-		    << ": Using more than 5 threads without Bloom filter does not scale, reverting to 5."
-		    << std::endl;
-	} else {
-		if (t > 48) {
-			std::cerr
-			    << progname
-			    << ": Using more than 48 threads with Bloom filter does not scale, reverting to 48."
-			    << std::endl;
-		}
-	}
 	std::vector<std::string> infiles(&argv[optind], &argv[argc]);
 	if (argc < 2) {
 		printUsage(progname);
@@ -191,34 +423,162 @@ main(int argc, char* argv[])
 	} else if (!w_set) {
 		printErrorMsg(progname, "missing option -- 'w'");
 		failed = true;
-	} else if (k == 0) {
+	} else if (ks.empty()) {
 		printErrorMsg(progname, "option has incorrect argument -- 'k'");
 		failed = true;
-	} else if (w == 0) {
+	} else if (ws.empty()) {
 		printErrorMsg(progname, "option has incorrect argument -- 'w'");
 		failed = true;
 	} else if (infiles.empty()) {
 		printErrorMsg(progname, "missing file operand");
 		failed = true;
 	}
+	// Pair up the values of -k and -w, where a single value pairs with every value of the other.
+	std::vector<MinimizerParams> params;
+	std::vector<std::string> outfiles;
+	if (!failed) {
+		size_t n = std::max(ks.size(), ws.size());
+		if ((ks.size() != 1 && ks.size() != n) || (ws.size() != 1 && ws.size() != n)) {
+			printErrorMsg(progname, "-k and -w must have the same number of values, or one");
+			failed = true;
+		}
+		for (size_t i = 0; i < n; ++i) {
+			MinimizerParams pair;
+			pair.k = ks[ks.size() == 1 ? 0 : i];
+			pair.w = ws[ws.size() == 1 ? 0 : i];
+			params.push_back(pair);
+		}
+		if (n == 1) {
+			outfiles.push_back(outfile.empty() ? "/dev/stdout" : outfile);
+		} else {
+			outfiles = splitList(outfile);
+			if (outfiles.size() != n) {
+				printErrorMsg(progname, "-o must name one output file per pair of -k and -w");
+				failed = true;
+			}
+			if (aggregate != 0 || autoFilter != 0) {
+				printErrorMsg(
+				    progname, "--aggregate and --auto-filter require a single pair of -k and -w");
+				failed = true;
+			}
+			bool sameK = std::all_of(
+			    params.begin(), params.end(), [&](const MinimizerParams& pair) {
+				    return pair.k == params[0].k;
+			    });
+			if ((withRepeat || withSolid) && !sameK) {
+				printErrorMsg(progname, "the Bloom filters of -r and -s require a single -k");
+				failed = true;
+			}
+		}
+	}
+	if (binary != 0 && (withPositions != 0 || withStrands != 0)) {
+		printErrorMsg(progname, "--binary cannot be used with --pos or --strand");
+		failed = true;
+	}
+	if (aggregate != 0 && (withPositions != 0 || withStrands != 0)) {
+		printErrorMsg(progname, "--aggregate cannot be used with --pos or --strand");
+		failed = true;
+	}
+	if (autoFilter == 0 && (repeatThreshold != 0 || solidThreshold != 0)) {
+		printErrorMsg(progname, "--repeat-threshold and --solid-threshold require --auto-filter");
+		failed = true;
+	}
+	if (autoFilter != 0) {
+		// The input is read once to count the minimizers, and again to filter them.
+		for (const auto& infile : infiles) {
+			struct stat st;
+			if (infile == "-" || stat(infile.c_str(), &st) != 0 || !S_ISREG(st.st_mode)) {
+				printErrorMsg(progname, "--auto-filter requires regular input files: " + infile);
+				failed = true;
+				break;
+			}
+		}
+	}
+	RollNtHash roll = selectRollNtHash(simd);
+	if (roll == nullptr) {
+		printErrorMsg(progname, "option has incorrect argument -- 'simd'");
+		failed = true;
+	}
 	if (failed) {
 		exit(EXIT_FAILURE);
 	}
+	if (withRepeat) {
+		loadBloomFilter(progname, "repeat", repeatPath, populate != 0, hugepages != 0, repeatBF);
+	}
+	if (withSolid) {
+		loadBloomFilter(progname, "solid", solidPath, populate != 0, hugepages != 0, solidBF);
+	}
 
+	// Aggregate the barcodes of all the input files into one output.
+	std::unique_ptr<BarcodeAggregator> aggregator;
+	if (aggregate != 0) {
+		aggregator.reset(new BarcodeAggregator(aggregateMemory << 20));
+	}
 	for (auto& infile : infiles) {
+		if (infile == "-") {
+			infile = "/dev/stdin";
+		}
+	}
+	// The reads of each file follow those of the previous file, unless the output is unordered
+	// anyway.
+	bool fileOrder = interleaveFiles == 0 && unordered == 0;
+	std::unique_ptr<MinimizerSketch> sketch;
+	if (autoFilter != 0) {
+		sketch.reset(new MinimizerSketch(autoFilterMemory << 20));
+		if (verbose) {
+			std::cerr << "Counting minimizers" << std::endl;
+		}
 		minimizeReads(
-		    infile == "-" ? "/dev/stdin" : infile,
-		    outfile,
-		    k,
-		    w,
+		    infiles,
+		    outfiles,
+		    params,
 		    t,
 		    withRepeat,
 		    withSolid,
 		    withPositions,
 		    withStrands,
-		    verbose,
+		    binary,
+		    false,
+		    roll,
 		    repeatBF,
-		    solidBF);
+		    solidBF,
+		    nullptr,
+		    sketch.get(),
+		    concurrentFiles,
+		    fileOrder,
+		    pieceLength,
+		    unordered != 0,
+		    withStats != 0,
+		    statsInterval);
+		sketch->finish(repeatThreshold, solidThreshold);
+		std::cerr << "The mode minimizer count is " << sketch->getMode() << ".\n"
+		          << "The repeat minimizer count is " << sketch->getRepeatThreshold() << ".\n"
+		          << "The solid minimizer count is " << sketch->getSolidThreshold() << ".\n";
+	}
+	minimizeReads(
+	    infiles,
+	    outfiles,
+	    params,
+	    t,
+	    withRepeat,
+	    withSolid,
+	    withPositions,
+	    withStrands,
+	    binary,
+	    verbose,
+	    roll,
+	    repeatBF,
+	    solidBF,
+	    aggregator.get(),
+	    sketch.get(),
+	    concurrentFiles,
+	    fileOrder,
+	    pieceLength,
+	    unordered != 0,
+	    withStats != 0,
+	    statsInterval);
+	if (aggregator) {
+		aggregator->write(outfiles[0], binary != 0);
 	}
 
 	return 0;
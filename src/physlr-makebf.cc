@@ -1,7 +1,12 @@
+#include <algorithm>
+#include <atomic>
+#include <cctype>
 #include <fstream>
 #include <getopt.h>
 #include <iomanip>
 #include <iostream>
+#include <limits>
+#include <memory>
 #include <sstream>
 #include <string>
 #include <vector>
@@ -11,7 +16,14 @@
 #endif
 
 #include "btl_bloomfilter/BloomFilter.hpp"
+#include "btl_bloomfilter/CountingBloomFilter.hpp"
 #include "btl_bloomfilter/vendor/ntHashIterator.hpp"
+#include "indexlr-fastx.h"
+#include "indexlr-minimize.h"
+#include "indexlr-sketch.h"
+
+// The counts of k-mers of reads saturate at this count.
+static const unsigned MAX_KMER_COUNT = std::numeric_limits<uint8_t>::max();
 
 static void
 printErrorMsg(const std::string& progname, const std::string& msg)
@@ -23,14 +35,29 @@ static void
 printUsage(const std::string& progname)
 {
 	std::cout << "Usage:  " << progname
-	          << "  -k K [-v] [-o FILE] FILE...\n\n"
+	          << "  -k K [-v] [-o FILE] FILE...\n"
+	             "        " << progname << "  --reads -k K [-v] [-o FILE] [-s FILE] FILE...\n\n"
 	             "  -k K       use K as k-mer size\n"
 	             "  -b B       Bloom filter size in Bytes\n"
+	             "  -H N       set N bits per k-mer [1]. More than one requires --blocked\n"
+	             "  --blocked  build a blocked Bloom filter, which sets the bits of a k-mer in\n"
+	             "             one 64-byte block, so that a query reads one cache line\n"
 	             "  -v         enable verbose output\n"
-	             "  -o FILE    write Bloom filter to FILE [required]\n"
+	             "  -o FILE    write Bloom filter to FILE [required]. With --reads, the filter of\n"
+	             "             repeat k-mers\n"
+	             "  --reads    count the k-mers of FASTQ or FASTA files of reads, which may be\n"
+	             "             gzipped, rather than read ntHits output. Uses one byte of memory\n"
+	             "             per bit of the filter\n"
+	             "  -s FILE    with --reads, also write the Bloom filter of solid k-mers to FILE\n"
+	             "  --histogram=FILE  with --reads, also write the histogram of k-mer counts to\n"
+	             "             FILE in the format of ntCard\n"
+	             "  --repeat-threshold=N  k-mers counted at least N times are repeats, where N\n"
+	             "             is at most 255 [3 times the mode of the k-mer count histogram]\n"
+	             "  --solid-threshold=N  k-mers counted at least N times are solid, where N is\n"
+	             "             at most 255 [the first minimum of the k-mer count histogram]\n"
 	             "  -t N       use N number of threads [1]\n"
 	             "  --help     display this help and exit\n"
-	             "  FILE       space separated list of ntHits tsv output files\n";
+	             "  FILE       space separated list of ntHits tsv output files, or of reads\n";
 }
 
 static void
@@ -44,6 +71,209 @@ printBloomStats(BloomFilter& bloom, ostream& os)
 	   << "\n";
 }
 
+// Read chunks of whole lines of ntHits output, each "kmer count", and insert their k-mers into
+// the Bloom filter as they are read, so that memory does not grow with the input.
+// Threads take turns to read a chunk and then parse and insert it in parallel.
+static void
+insertKmers(
+    std::istream& is,
+    BloomFilter& bloomFilter,
+    unsigned hashNum,
+    unsigned k,
+    unsigned t,
+    bool verbose,
+    std::atomic<uint64_t>& counter)
+{
+	// Size of the chunks read by each thread
+	const size_t chunkBytes = 1 << 20;
+	// The beginning of a line that spans chunks
+	std::string carry;
+#pragma omp parallel num_threads(t)
+	{
+		std::vector<char> chunk;
+		std::string kmer;
+		while (true) {
+			bool more = false;
+#pragma omp critical(readChunk)
+			{
+				chunk.assign(carry.begin(), carry.end());
+				carry.clear();
+				size_t size = chunk.size();
+				chunk.resize(size + chunkBytes);
+				is.read(chunk.data() + size, chunkBytes);
+				chunk.resize(size + is.gcount());
+				// Keep the partial last line for the next chunk.
+				auto end = std::find(chunk.rbegin(), chunk.rend(), '\n').base();
+				if (is.good()) {
+					carry.assign(end, chunk.end());
+					chunk.erase(end, chunk.end());
+				}
+				more = !chunk.empty() || !carry.empty();
+			}
+			if (!more) {
+				break;
+			}
+			for (auto p = chunk.begin(); p != chunk.end();) {
+				auto eol = std::find(p, chunk.end(), '\n');
+				auto begin = std::find_if(p, eol, [](char c) {
+					return std::isspace(static_cast<unsigned char>(c)) == 0;
+				});
+				auto end = std::find_if(begin, eol, [](char c) {
+					return std::isspace(static_cast<unsigned char>(c)) != 0;
+				});
+				p = eol == chunk.end() ? eol : eol + 1;
+				if (begin == end) {
+					continue;
+				}
+				kmer.assign(begin, end);
+				ntHashIterator itr(kmer, hashNum, k);
+				while (itr != ntHashIterator::end()) {
+					bloomFilter.insert(*itr);
+					++itr;
+				}
+				if (verbose) {
+					uint64_t n = counter.fetch_add(1, std::memory_order_relaxed) + 1;
+					if (n % 100000 == 0) {
+						std::cerr << "Processed " + std::to_string(n) + " kmers.\n";
+					}
+				}
+			}
+		}
+	}
+}
+
+// Count the k-mers of a FASTQ or FASTA file of reads. counts has a counter for each bit of the
+// filter layout, so that a k-mer counted at least N times has all its bits set in a filter with
+// the bits of the counters of at least N. Every counter of a k-mer is incremented with a
+// saturating atomic add, so that the counts do not depend on the order of the threads.
+// Threads take turns to parse a block of reads.
+static void
+countKmers(
+    const std::string& path,
+    unsigned k,
+    unsigned t,
+    const BloomFilter& layout,
+    CountingBloomFilter<uint8_t>& counts,
+    std::atomic<uint64_t>& counter)
+{
+	InflateStream stream(path, t);
+	if (stream.peek() == EOF) {
+		std::cerr << "physlr-makebf: error: Empty input file: " << path << '\n';
+		exit(EXIT_FAILURE);
+	}
+	FastxParser parser(stream);
+	const RollNtHash roll = selectRollNtHash();
+#pragma omp parallel num_threads(t)
+	{
+		ReadBlock reads;
+		KmerHasher hasher(k, roll);
+		std::vector<uint64_t> positions(layout.getHashNum());
+		while (true) {
+			size_t n = 0;
+#pragma omp critical(readBlock)
+			n = parser.readBlock(reads, 0);
+			if (n == 0) {
+				break;
+			}
+			for (size_t i = 0; i < n; ++i) {
+				const Read& read = reads.data[i];
+				hasher.forEach(read.sequence.data, read.sequence.size, [&](const HashData& hash) {
+					layout.getBitPositions(&hash.hash1, positions.data());
+					counts.incrementAll(positions);
+				});
+			}
+			counter.fetch_add(n, std::memory_order_relaxed);
+		}
+	}
+}
+
+// Write the histogram of k-mer counts as ntCard does, one line of k, count and frequency per
+// count from 1.
+static void
+writeHistogram(const std::string& path, unsigned k, const std::vector<uint64_t>& hist)
+{
+	std::ofstream ofs(path);
+	assert_good(ofs, path);
+	ofs << "k\tf\tn\n";
+	for (size_t c = 1; c < hist.size(); ++c) {
+		ofs << k << '\t' << c << '\t' << hist[c] << '\n';
+	}
+	ofs.flush();
+	assert_good(ofs, path);
+}
+
+// Count the k-mers of the reads, and write the filter of repeat k-mers to outfile and, if
+// solidfile is not empty, the filter of solid k-mers to solidfile, and if histfile is not empty,
+// the histogram of k-mer counts to histfile. A threshold of zero is found from the histogram.
+static void
+buildFromReads(
+    std::vector<std::string>& infiles,
+    BloomFilter& repeatBF,
+    const std::string& outfile,
+    const std::string& solidfile,
+    const std::string& histfile,
+    unsigned k,
+    unsigned t,
+    unsigned repeatThreshold,
+    unsigned solidThreshold,
+    bool verbose,
+    std::atomic<uint64_t>& counter)
+{
+	const size_t size = repeatBF.getFilterSize();
+	CountingBloomFilter<uint8_t> counts(size, repeatBF.getHashNum(), k, 0);
+	for (auto& infile : infiles) {
+		infile = (infile == "-") ? "/dev/stdin" : infile;
+		if (verbose) {
+			std::cerr << "Counting kmers of " << infile << std::endl;
+		}
+		countKmers(infile, k, t, repeatBF, counts, counter);
+	}
+	if (verbose) {
+		std::cerr << "Counted the kmers of " << counter << " reads." << std::endl;
+	}
+
+	std::vector<uint64_t> hist(MAX_KMER_COUNT + 1);
+	for (size_t i = 0; i < size; ++i) {
+		++hist[counts[i]];
+	}
+	if (!histfile.empty()) {
+		writeHistogram(histfile, k, hist);
+	}
+	unsigned minimum = 0, mode = 0;
+	findHistogramMode(hist, minimum, mode);
+	if (repeatThreshold == 0) {
+		repeatThreshold = std::min(3 * mode, MAX_KMER_COUNT);
+	}
+	if (solidThreshold == 0) {
+		solidThreshold = minimum;
+	}
+	std::cerr << "The mode k-mer count is " << mode << ".\n"
+	          << "The repeat k-mer count is " << repeatThreshold << ".\n";
+	if (!solidfile.empty()) {
+		std::cerr << "The solid k-mer count is " << solidThreshold << ".\n";
+	}
+
+	std::unique_ptr<BloomFilter> solidBF;
+	if (!solidfile.empty()) {
+		solidBF.reset(new BloomFilter(size, repeatBF.getHashNum(), k, repeatBF.isBlocked()));
+	}
+#pragma omp parallel for num_threads(t)
+	for (size_t i = 0; i < size; ++i) {
+		if (counts[i] >= repeatThreshold) {
+			repeatBF.insertBit(i);
+		}
+		if (solidBF && counts[i] >= solidThreshold) {
+			solidBF->insertBit(i);
+		}
+	}
+	printBloomStats(repeatBF, std::cerr);
+	repeatBF.storeFilter(outfile);
+	if (solidBF) {
+		printBloomStats(*solidBF, std::cerr);
+		solidBF->storeFilter(solidfile);
+	}
+}
+
 int
 main(int argc, char* argv[])
 {
@@ -52,6 +282,15 @@ main(int argc, char* argv[])
 	int c;
 	int optindex = 0;
 	static int help = 0;
+	static int blocked = 0;
+	static int reads = 0;
+	unsigned repeatThreshold = 0;
+	unsigned solidThreshold = 0;
+	std::string solidfile;
+	std::string histfile;
+	const int OPT_REPEAT_THRESHOLD = 256;
+	const int OPT_SOLID_THRESHOLD = 257;
+	const int OPT_HISTOGRAM = 258;
 	unsigned k = 0;
 	uint64_t filterSize = 0;
 	bool verbose = false;
@@ -62,8 +301,22 @@ main(int argc, char* argv[])
 	char* end = nullptr;
 	std::string outfile;
 	static const struct option longopts[] = { { "help", no_argument, &help, 1 },
+		                                      { "blocked", no_argument, &blocked, 1 },
+		                                      { "reads", no_argument, &reads, 1 },
+		                                      { "repeat-threshold",
+		                                        required_argument,
+		                                        nullptr,
+		                                        OPT_REPEAT_THRESHOLD },
+		                                      { "solid-threshold",
+		                                        required_argument,
+		                                        nullptr,
+		                                        OPT_SOLID_THRESHOLD },
+		                                      { "histogram",
+		                                        required_argument,
+		                                        nullptr,
+		                                        OPT_HISTOGRAM },
 		                                      { nullptr, 0, nullptr, 0 } };
-	while ((c = getopt_long(argc, argv, "b:k:o:vt:", longopts, &optindex)) != -1) {
+	while ((c = getopt_long(argc, argv, "b:k:o:s:vt:H:", longopts, &optindex)) != -1) {
 		switch (c) {
 		case 0:
 			break;
@@ -83,6 +336,29 @@ main(int argc, char* argv[])
 		case 't':
 			t = strtoul(optarg, &end, 10);
 			break;
+		case 'H':
+			hashNum = strtoul(optarg, &end, 10);
+			break;
+		case 's':
+			solidfile.assign(optarg);
+			break;
+		case OPT_REPEAT_THRESHOLD:
+			repeatThreshold = strtoul(optarg, &end, 10);
+			if (*end != '\0' || repeatThreshold == 0 || repeatThreshold > MAX_KMER_COUNT) {
+				printErrorMsg(progname, "option has incorrect argument -- 'repeat-threshold'");
+				exit(EXIT_FAILURE);
+			}
+			break;
+		case OPT_HISTOGRAM:
+			histfile.assign(optarg);
+			break;
+		case OPT_SOLID_THRESHOLD:
+			solidThreshold = strtoul(optarg, &end, 10);
+			if (*end != '\0' || solidThreshold == 0 || solidThreshold > MAX_KMER_COUNT) {
+				printErrorMsg(progname, "option has incorrect argument -- 'solid-threshold'");
+				exit(EXIT_FAILURE);
+			}
+			break;
 		default:
 			exit(EXIT_FAILURE);
 		}
@@ -104,56 +380,65 @@ main(int argc, char* argv[])
 	} else if (filterSize == 0) {
 		printErrorMsg(progname, "option has incorrect argument -- 'b");
 		failed = true;
+	} else if (hashNum == 0) {
+		printErrorMsg(progname, "option has incorrect argument -- 'H'");
+		failed = true;
+	} else if (hashNum > 1 && blocked == 0) {
+		printErrorMsg(progname, "-H greater than 1 requires --blocked");
+		failed = true;
 	} else if (infiles.empty()) {
 		printErrorMsg(progname, "missing file operand");
 		failed = true;
+	} else if (reads == 0 && !solidfile.empty()) {
+		printErrorMsg(progname, "-s requires --reads");
+		failed = true;
+	} else if (reads == 0 && !histfile.empty()) {
+		printErrorMsg(progname, "--histogram requires --reads");
+		failed = true;
 	}
 	if (failed) {
 		exit(EXIT_FAILURE);
 	}
 
-	std::vector<std::string> kmerVect;
-	kmerVect.reserve(10000);
-	if (verbose) {
-		std::cerr << "Collecting Kmers to insert into bloom filter" << std::endl;
+	if (blocked != 0 && filterSize % filterBlockBits != 0) {
+		filterSize += filterBlockBits - filterSize % filterBlockBits;
 	}
-	for (auto& infile : infiles) {
-		infile = (infile == "-") ? "/dev/stdin" : infile;
-		std::ifstream infileStream(infile);
-		std::string kmer;
-		int count;
-		while (infileStream >> kmer >> count) {
-			kmerVect.push_back(kmer);
-		}
-	}
-
-	BloomFilter bloomFilter(filterSize, hashNum, k);
+	BloomFilter bloomFilter(filterSize, hashNum, k, blocked != 0);
 	if (verbose) {
 		std::cerr << "Made Bloom filter with:\n"
 		          << "kmer size                 = " << k << "\n"
 		          << "Bloom filter size         = " << filterSize << "\n"
 		          << std::endl;
-		std::cerr << "Inserting " << kmerVect.size() << " kmers into Bloom filter"
-		          << "Using " << t << " threads." << std::endl;
 	}
 
-	uint64_t counter = 0;
-#pragma omp parallel for num_threads(t)
-	for (auto vectIt = kmerVect.begin(); vectIt < kmerVect.end(); ++vectIt) {
-		ntHashIterator itr(*vectIt, hashNum, k);
-		while (itr != ntHashIterator::end()) {
-			bloomFilter.insert(*itr);
-			++itr;
-		}
-		if (verbose) {
-#pragma omp critical
-			{
-				counter++;
-				if (counter % 100000 == 0) {
-					std::cerr << "Processed " << counter << " kmers." << std::endl;
-				}
-			}
-		}
+	std::atomic<uint64_t> counter{ 0 };
+	if (reads != 0) {
+		buildFromReads(
+		    infiles,
+		    bloomFilter,
+		    outfile,
+		    solidfile,
+		    histfile,
+		    k,
+		    t,
+		    repeatThreshold,
+		    solidThreshold,
+		    verbose,
+		    counter);
+		return 0;
+	}
+	if (verbose) {
+		std::cerr << "Inserting kmers into Bloom filter "
+		          << "using " << t << " threads." << std::endl;
+	}
+	for (auto& infile : infiles) {
+		infile = (infile == "-") ? "/dev/stdin" : infile;
+		std::ifstream infileStream(infile);
+		assert_good(infileStream, infile);
+		insertKmers(infileStream, bloomFilter, blocked != 0 ? 1 : hashNum, k, t, verbose, counter);
+	}
+	if (verbose) {
+		std::cerr << "Inserted " << counter << " kmers." << std::endl;
 	}
 
 	printBloomStats(bloomFilter, std::cerr);
@@ -5,6 +5,7 @@
  *      Author: cjustin
  */
 
+#include "physlr-mxstream.h"
 #include "tsl/robin_map.h"
 #include "tsl/robin_set.h"
 #include <cstdint>
@@ -191,26 +192,40 @@ main(int argc, char* argv[])
 	     itr++) {
 		std::ifstream fh;
 		fh.open(itr->c_str());
-		std::string line;
 		std::cerr << "Loading file " << *itr << std::endl;
-		while (getline(fh, line)) {
-			std::stringstream ss(line);
-			ss >> barcodeBuffer;
+		auto addMinimizers = [&](const std::vector<Minimizer>& minimizers) {
 			const auto& barcode = barcodes.find(barcodeBuffer);
+			BarcodeID id = 0;
 			if (barcode == barcodes.end()) {
 				barcodeToStr.emplace_back(barcodeBuffer);
-				barcodes[barcodeBuffer] = barcodeToStr.size() - 1;
+				id = barcodeToStr.size() - 1;
+				barcodes[barcodeBuffer] = id;
 				barcodeToMinimizer.emplace_back(std::vector<Minimizer>());
-				while (ss >> minimizerBuffer) {
-					barcodeToMinimizer[barcodeToStr.size() - 1].emplace_back(minimizerBuffer);
-					minimizerToBarcode[minimizerBuffer].insert(barcodeToStr.size() - 1);
-				}
 			} else {
-				while (ss >> minimizerBuffer) {
-					barcodeToMinimizer[barcode->second].emplace_back(minimizerBuffer);
-					minimizerToBarcode[minimizerBuffer].insert(barcode->second);
-				}
+				id = barcode->second;
+			}
+			for (const auto& minimizer : minimizers) {
+				barcodeToMinimizer[id].emplace_back(minimizer);
+				minimizerToBarcode[minimizer].insert(id);
+			}
+		};
+		std::vector<Minimizer> minimizers;
+		if (isMxStream(fh)) {
+			MxReader reader(fh, *itr);
+			while (reader.read(barcodeBuffer, minimizers)) {
+				addMinimizers(minimizers);
+			}
+			continue;
+		}
+		std::string line;
+		while (getline(fh, line)) {
+			std::stringstream ss(line);
+			ss >> barcodeBuffer;
+			minimizers.clear();
+			while (ss >> minimizerBuffer) {
+				minimizers.emplace_back(minimizerBuffer);
 			}
+			addMinimizers(minimizers);
 		}
 	}
 
@@ -1,3 +1,4 @@
+#include "physlr-mxstream.h"
 #include "tsl/robin_map.h"
 #include "tsl/robin_set.h"
 
@@ -286,24 +287,38 @@ getBarcodeToMinimizer(
 
 	std::ifstream fh;
 	fh.open(inputFile);
-	std::string line;
 	std::cerr << "Loading file " << inputFile << std::endl;
-	while (getline(fh, line)) {
-		std::stringstream ss(line);
-		ss >> barcodeBuffer;
+	auto addMinimizers = [&](const std::vector<Minimizer>& minimizers) {
 		const auto& barcode = barcodes.find(barcodeBuffer);
+		BarcodeID id = 0;
 		if (barcode == barcodes.end()) {
 			barcodeToStr.emplace_back(barcodeBuffer);
-			barcodes[barcodeBuffer] = barcodeToStr.size() - 1;
+			id = barcodeToStr.size() - 1;
+			barcodes[barcodeBuffer] = id;
 			barcodeToMinimizer.emplace_back(std::vector<Minimizer>());
-			while (ss >> minimizerBuffer) {
-				barcodeToMinimizer[barcodeToStr.size() - 1].emplace_back(minimizerBuffer);
-			}
 		} else {
-			while (ss >> minimizerBuffer) {
-				barcodeToMinimizer[barcode->second].emplace_back(minimizerBuffer);
-			}
+			id = barcode->second;
+		}
+		auto& barcodeMinimizers = barcodeToMinimizer[id];
+		barcodeMinimizers.insert(barcodeMinimizers.end(), minimizers.begin(), minimizers.end());
+	};
+	std::vector<Minimizer> minimizers;
+	if (isMxStream(fh)) {
+		MxReader reader(fh, inputFile);
+		while (reader.read(barcodeBuffer, minimizers)) {
+			addMinimizers(minimizers);
+		}
+		return;
+	}
+	std::string line;
+	while (getline(fh, line)) {
+		std::stringstream ss(line);
+		ss >> barcodeBuffer;
+		minimizers.clear();
+		while (ss >> minimizerBuffer) {
+			minimizers.emplace_back(minimizerBuffer);
 		}
+		addMinimizers(minimizers);
 	}
 }
 